@@ -0,0 +1,92 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <omp.h>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include <faiss/IndexFlat.h>
+#include <faiss/IndexIVFFlat.h>
+#include <faiss/utils/random.h>
+#include <faiss/utils/utils.h>
+
+/************************
+ * Compares the early-stopping ConANN search with the upfront coarse
+ * assignment (quantizer->search of nprobe_budget centroids) and with the lazy
+ * one (IndexIVF::lazy_coarse_assignment: BLAS distances to all the centroids,
+ * ranked one window at a time on demand). Both must return the same results; the lazy one should
+ * not be slower, for batches and for single queries.
+ */
+
+int main(int argc, char** argv) {
+    using idx_t = faiss::idx_t;
+    int d = 32;
+    size_t nb = 200 * 1000;
+    size_t nlist = argc > 1 ? atoi(argv[1]) : 1024;
+    size_t nq = 2000;
+    size_t ncalib = 1000;
+    int k = 10;
+    std::vector<float> data((nb + nq + ncalib) * d);
+    float* xb = data.data();
+    float* xq = xb + nb * d;
+    float* xcalib = xq + nq * d;
+    faiss::rand_smooth_vectors(nb + nq + ncalib, d, data.data(), 1234);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    printf("nb=%zd nlist=%zd nq=%zd nt=%d\n",
+           nb,
+           nlist,
+           nq,
+           omp_get_max_threads());
+    double t0 = faiss::getmillisecs();
+    index.train(nb, xb);
+    index.add(nb, xb);
+    printf("train + add: %.3f ms\n", faiss::getmillisecs() - t0);
+
+    // ground truth from the calibration sweep itself
+    auto calib = index.calibrate(
+            0.1, k, 0.5, 0.2, xcalib, ncalib, nullptr, 20, "bench");
+    printf("lamhat=%g nprobe_budget=%d\n", calib.lamhat, calib.nprobe_budget);
+
+    std::vector<float> D_eager(nq * k), D_lazy(nq * k);
+    std::vector<idx_t> I_eager(nq * k), I_lazy(nq * k);
+
+    for (int run = 0; run < 2; run++) {
+        const char* mode = run == 0 ? "batch" : "single query";
+        // best of 3
+        double t_eager = 1e30, t_lazy = 1e30;
+        for (int rep = 0; rep < 3; rep++) {
+            for (int lazy = 0; lazy < 2; lazy++) {
+                index.lazy_coarse_assignment = lazy;
+                float* D = lazy ? D_lazy.data() : D_eager.data();
+                idx_t* I = lazy ? I_lazy.data() : I_eager.data();
+                double t1 = faiss::getmillisecs();
+                if (run == 0) {
+                    index.search_conann(nq, xq, D, I, calib);
+                } else {
+                    for (size_t i = 0; i < nq; i++) {
+                        index.search_conann(
+                                1, xq + i * d, D + i * k, I + i * k, calib);
+                    }
+                }
+                double t = faiss::getmillisecs() - t1;
+                double& best = lazy ? t_lazy : t_eager;
+                best = std::min(best, t);
+            }
+        }
+        printf("%s: eager coarse assignment %.3f ms, lazy %.3f ms\n",
+               mode,
+               t_eager,
+               t_lazy);
+        FAISS_THROW_IF_NOT(I_eager == I_lazy);
+        FAISS_THROW_IF_NOT(D_eager == D_lazy);
+    }
+
+    return 0;
+}
@@ -135,6 +135,9 @@ int main(int argc, char **argv) {
     std::string param4 = argv[4]; // alpha
     std::string param5 = argv[5]; // nlist value
     std::string param6 = argv[6]; // optional: k
+    // optional: "fused" to take the ground truth from the calibration sweep
+    // instead of the indices-k / distances-k files
+    bool fused_gt = argc - 1 > 6 && std::string(argv[7]) == "fused";
 
     std::string dataset_name = param1;
     float calib_sz = std::stof(param2);
@@ -293,10 +296,15 @@ int main(int argc, char **argv) {
         assert(d == d2 || !"query does not have same dimension as train set");
     }
 
-    size_t k;         // nb of results per query in the GT
-    faiss::idx_t *gt; // nq * k matrix of ground-truth nearest-neighbors
+    size_t k;                   // nb of results per query in the GT
+    faiss::idx_t *gt = nullptr; // nq * k matrix of ground-truth nearest-neighbors
+    float *gt_v = nullptr;
 
-    {
+    if (fused_gt) {
+        k = std::stoi(selection_k);
+        printf("[%.3f s] Ground truth from the calibration sweep, k=%ld\n",
+               elapsed() - t0, k);
+    } else {
         printf("[%.3f s] Loading ground truth for %ld queries\n",
                elapsed() - t0, nq);
 
@@ -310,12 +318,8 @@ int main(int argc, char **argv) {
             gt[i] = gt_int[i];
         }
         delete[] gt_int;
-    }
 
-    size_t kk;
-    float *gt_v;
-
-    {
+        size_t kk;
         printf("[%.3f s] Loading groud truth vector\n", elapsed() - t0);
         size_t nq3;
         gt_v = fvecs_read(gtD.c_str(), &kk, &nq3);
@@ -18,6 +18,7 @@
 #include "faiss/IndexFlat.h"
 #include "faiss/IndexIVFFlat.h"
 #include "faiss/IndexIVFPQ.h"
+#include "faiss/IndexScalarQuantizer.h"
 #include "faiss/index_io.h"
 
 #include <fstream>
@@ -136,6 +137,16 @@ int main(int argc, char **argv) {
     std::string param4 = argv[4]; // alpha
     std::string param5 = argv[5]; // nlist value
     std::string param6 = argv[6]; // optional: k
+    // optional flags after k:
+    // "fused" to take the ground truth from the calibration sweep (the
+    // exhaustive PQ search) instead of the indices-k / distances-k files,
+    // "refine" to re-rank the PQ shortlists with an SQ8 index, so the
+    // stopping rule is calibrated on the refined distances
+    bool fused_gt = false, refine = false;
+    for (int a = 7; a < argc; a++) {
+        fused_gt = fused_gt || std::string(argv[a]) == "fused";
+        refine = refine || std::string(argv[a]) == "refine";
+    }
 
     std::string dataset_name = param1;
     float calib_sz = std::stof(param2);
@@ -238,6 +249,7 @@ int main(int argc, char **argv) {
 
     // faiss::IndexIVFFlat *index;
     faiss::IndexIVFPQ *index;
+    faiss::IndexScalarQuantizer *refine_index = nullptr;
 
     size_t d;
 
@@ -267,6 +279,12 @@ int main(int argc, char **argv) {
         printf("[%.3f s] Training on %ld vectors\n", elapsed() - t0, ntt);
 
         index->train(ntt, xt);
+        if (refine) {
+            refine_index = new faiss::IndexScalarQuantizer(
+                d, faiss::ScalarQuantizer::QT_8bit);
+            refine_index->train(ntt, xt);
+            index->refine_index = refine_index;
+        }
         delete[] xt;
     }
 
@@ -281,6 +299,9 @@ int main(int argc, char **argv) {
                d);
 
         index->add(nb, xb);
+        if (refine_index) {
+            refine_index->add(nb, xb);
+        }
 
         delete[] xb;
     }
@@ -296,10 +317,15 @@ int main(int argc, char **argv) {
         assert(d == d2 || !"query does not have same dimension as train set");
     }
 
-    size_t k;         // nb of results per query in the GT
-    faiss::idx_t *gt; // nq * k matrix of ground-truth nearest-neighbors
+    size_t k;                   // nb of results per query in the GT
+    faiss::idx_t *gt = nullptr; // nq * k matrix of ground-truth nearest-neighbors
+    float *gt_v = nullptr;
 
-    {
+    if (fused_gt) {
+        k = std::stoi(selection_k);
+        printf("[%.3f s] Ground truth from the calibration sweep, k=%ld\n",
+               elapsed() - t0, k);
+    } else {
         printf("[%.3f s] Loading ground truth for %ld queries\n",
                elapsed() - t0, nq);
 
@@ -313,12 +339,8 @@ int main(int argc, char **argv) {
             gt[i] = gt_int[i];
         }
         delete[] gt_int;
-    }
-
-    size_t kk;
-    float *gt_v;
 
-    {
+        size_t kk;
         printf("[%.3f s] Loading groud truth vector\n", elapsed() - t0);
         size_t nq3;
         gt_v = fvecs_read(gtD.c_str(), &kk, &nq3);
@@ -350,26 +372,29 @@ int main(int argc, char **argv) {
     std::cout << "alpha=" << alpha << ", test fnr=" << avg_fnr
               << ", avg cls searched=" << c << std::endl;
 
+    std::string prefix = refine ? "ConANN-pq-refine" : "ConANN-pq";
+
     std::ostringstream fnr_filename;
     // std::string dataset_key = param1 + "-" + std::to_string(input_nlist) +
     // "-" + selection_k;
-    fnr_filename << "../ConANN-pq-error-" << dataset_name << "-"
+    fnr_filename << "../" << prefix << "-error-" << dataset_name << "-"
                  << std::to_string(input_nlist) << "-" << selection_k << "-"
                  << alpha << "-" << calib_sz << "-" << tune_sz << ".log";
     write_to_file(fnr, fnr_filename.str());
 
     std::ostringstream cls_filename;
-    cls_filename << "../ConANN-pq-efficiency-" << dataset_name << "-"
+    cls_filename << "../" << prefix << "-efficiency-" << dataset_name << "-"
                  << std::to_string(input_nlist) << "-" << selection_k << "-"
                  << alpha << "-" << calib_sz << "-" << tune_sz << ".log";
     write_to_file(cls, cls_filename.str());
 
     std::ostringstream time_filename;
-    time_filename << "../ConANN-pq-timing-" << dataset_name << "-"
+    time_filename << "../" << prefix << "-timing-" << dataset_name << "-"
                 << std::to_string(input_nlist) << "-" << selection_k << "-"
                 << alpha << "-" << calib_sz << "-" << tune_sz << ".csv";
     write_time_report_csv(time_filename.str(), index->time_report);
 
     delete index;
+    delete refine_index;
     return 0;
 }
\ No newline at end of file
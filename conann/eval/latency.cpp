@@ -127,6 +127,7 @@ int main(int argc, char **argv) {
     std::string param4 = argv[4]; // alpha
     std::string param5 = argv[5]; // nlist value
     std::string param6 = argv[6]; // optional: k
+    // argv[7], optional: parallel_mode of the search
 
     std::string dataset_name = param1;
     float calib_sz = std::stof(param2);
@@ -328,6 +329,12 @@ int main(int argc, char **argv) {
     printf("[%.3f s] ConANN Evaluation on %ld queries\n", elapsed() - t0,
            nq - test_start_idx);
     std::vector<double> latencies;
+    // rank the centroids only as far as each query actually probes
+    index->lazy_coarse_assignment = true;
+    // optional: parallel_mode 1 scans the lists of each query in parallel
+    if (argc - 1 > 6) {
+        index->parallel_mode = std::stoi(argv[7]);
+    }
 
     std::vector<std::vector<faiss::idx_t>> prediction_set(nq - test_start_idx, std::vector<faiss::idx_t>(k));
     std::vector<std::vector<faiss::idx_t>> gt_labels(nq - test_start_idx, std::vector<faiss::idx_t>(k));
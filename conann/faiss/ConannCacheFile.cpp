@@ -0,0 +1,193 @@
+#include <faiss/ConannCacheFile.h>
+
+#include <faiss/impl/FaissAssert.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+namespace faiss {
+
+namespace {
+
+const char conann_cache_magic[4] = {'C', 'N', 'N', 'C'};
+
+uint64_t align_section(uint64_t offset) {
+    return (offset + 63) & ~uint64_t(63);
+}
+
+// end of a section of n items of the given size, false on overflow
+bool section_end(uint64_t offset, uint64_t n, uint64_t size, uint64_t &end) {
+    uint64_t bytes;
+    return !__builtin_mul_overflow(n, size, &bytes) &&
+           !__builtin_add_overflow(offset, bytes, &end);
+}
+
+// reads and checks the header, returns an error message or nullptr
+const char *read_header(FILE *f, size_t file_size,
+                        ConannCacheFile::Header &h) {
+    if (fread(&h, sizeof(h), 1, f) != 1) {
+        return "truncated header";
+    }
+    if (memcmp(h.magic, conann_cache_magic, 4) != 0) {
+        return "bad magic";
+    }
+    if (h.version != ConannCacheFile::current_version) {
+        return "unsupported version";
+    }
+    if (h.entry_size != sizeof(ConannTopkEntry)) {
+        return "incompatible entry size";
+    }
+    // the sizes come from the file: no product or sum may wrap around
+    uint64_t nonconf_n, nonconf_end, offsets_end, entries_end;
+    if (__builtin_mul_overflow(h.nq, h.nlist, &nonconf_n) ||
+        !section_end(h.nonconf_offset, nonconf_n, sizeof(float),
+                     nonconf_end) ||
+        h.nq == UINT64_MAX ||
+        !section_end(h.offsets_offset, h.nq + 1, sizeof(idx_t), offsets_end) ||
+        !section_end(h.entries_offset, h.n_entries, sizeof(ConannTopkEntry),
+                     entries_end)) {
+        return "sizes overflow";
+    }
+    if (h.total_size != file_size || h.nonconf_offset < sizeof(h) ||
+        nonconf_end > h.offsets_offset || offsets_end > h.entries_offset ||
+        entries_end > h.total_size) {
+        return "inconsistent sizes";
+    }
+    if (h.nonconf_offset % alignof(float) != 0 ||
+        h.offsets_offset % alignof(idx_t) != 0 ||
+        h.entries_offset % alignof(ConannTopkEntry) != 0) {
+        return "misaligned sections";
+    }
+    return nullptr;
+}
+
+size_t get_file_size(FILE *f) {
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0) {
+        return 0;
+    }
+    return st.st_size;
+}
+
+void write_padded(FILE *f, const void *data, size_t size, uint64_t offset,
+                  const std::string &fname) {
+    long pos = ftell(f);
+    FAISS_THROW_IF_NOT(pos >= 0 && uint64_t(pos) <= offset);
+    static const char zeros[64] = {};
+    FAISS_THROW_IF_NOT_FMT(fwrite(zeros, 1, offset - pos, f) == offset - pos,
+                           "write error in %s", fname.c_str());
+    FAISS_THROW_IF_NOT_FMT(size == 0 || fwrite(data, 1, size, f) == size,
+                           "write error in %s", fname.c_str());
+}
+
+} // namespace
+
+ConannCacheFile::ConannCacheFile(const std::string &filename)
+    : filename(filename) {
+    FILE *f = fopen(filename.c_str(), "r");
+    FAISS_THROW_IF_NOT_FMT(f, "could not open %s: %s", filename.c_str(),
+                           strerror(errno));
+    size_t file_size = get_file_size(f);
+    const char *err = read_header(f, file_size, header);
+    if (err) {
+        fclose(f);
+        FAISS_THROW_FMT("invalid ConANN cache %s: %s", filename.c_str(), err);
+    }
+
+    totsize = file_size;
+    ptr = mmap(nullptr, totsize, PROT_READ, MAP_SHARED, fileno(f), 0);
+    fclose(f);
+    FAISS_THROW_IF_NOT_FMT(ptr != MAP_FAILED, "could not mmap %s: %s",
+                           filename.c_str(), strerror(errno));
+
+    const uint8_t *base = (const uint8_t *)ptr;
+    nonconf = (const float *)(base + header.nonconf_offset);
+    offsets = (const idx_t *)(base + header.offsets_offset);
+    entries = (const ConannTopkEntry *)(base + header.entries_offset);
+    // the views index the entries with the offsets, they must stay in range
+    bool offsets_ok = offsets[0] == 0 &&
+                      offsets[header.nq] == (idx_t)header.n_entries;
+    for (size_t q = 0; offsets_ok && q < header.nq; q++) {
+        offsets_ok = offsets[q] <= offsets[q + 1];
+    }
+    if (!offsets_ok) {
+        munmap(ptr, totsize);
+        ptr = nullptr;
+        FAISS_THROW_FMT("invalid ConANN cache %s: bad offsets",
+                        filename.c_str());
+    }
+}
+
+ConannCacheFile::~ConannCacheFile() {
+    if (ptr && ptr != MAP_FAILED) {
+        munmap(ptr, totsize);
+    }
+}
+
+void ConannCacheFile::write(const std::string &filename, uint64_t fingerprint,
+                            const std::vector<std::vector<float>> &nonconf,
+                            const ConannPredictions &preds) {
+    FAISS_THROW_IF_NOT(nonconf.size() == preds.nq);
+    FAISS_THROW_IF_NOT(preds.offsets.size() == preds.nq + 1);
+
+    Header h;
+    memcpy(h.magic, conann_cache_magic, 4);
+    h.version = current_version;
+    h.entry_size = sizeof(ConannTopkEntry);
+    h.fingerprint = fingerprint;
+    h.nq = preds.nq;
+    h.nlist = preds.nlist;
+    h.k = preds.k;
+    h.n_entries = preds.entries.size();
+    h.nonconf_offset = align_section(sizeof(Header));
+    h.offsets_offset =
+        align_section(h.nonconf_offset + h.nq * h.nlist * sizeof(float));
+    h.entries_offset =
+        align_section(h.offsets_offset + (h.nq + 1) * sizeof(idx_t));
+    h.total_size = h.entries_offset + h.n_entries * sizeof(ConannTopkEntry);
+
+    std::string tmp_name = filename + ".tmp";
+    FILE *f = fopen(tmp_name.c_str(), "w");
+    FAISS_THROW_IF_NOT_FMT(f, "could not open %s for writing: %s",
+                           tmp_name.c_str(), strerror(errno));
+    try {
+        write_padded(f, &h, sizeof(h), 0, tmp_name);
+        for (size_t q = 0; q < h.nq; q++) {
+            FAISS_THROW_IF_NOT(nonconf[q].size() == h.nlist);
+            write_padded(f, nonconf[q].data(), h.nlist * sizeof(float),
+                         h.nonconf_offset + q * h.nlist * sizeof(float),
+                         tmp_name);
+        }
+        write_padded(f, preds.offsets.data(), (h.nq + 1) * sizeof(idx_t),
+                     h.offsets_offset, tmp_name);
+        write_padded(f, preds.entries.data(),
+                     h.n_entries * sizeof(ConannTopkEntry), h.entries_offset,
+                     tmp_name);
+    } catch (...) {
+        fclose(f);
+        remove(tmp_name.c_str());
+        throw;
+    }
+    FAISS_THROW_IF_NOT_FMT(fclose(f) == 0, "write error in %s",
+                           tmp_name.c_str());
+    FAISS_THROW_IF_NOT_FMT(rename(tmp_name.c_str(), filename.c_str()) == 0,
+                           "could not rename %s: %s", tmp_name.c_str(),
+                           strerror(errno));
+}
+
+bool ConannCacheFile::is_valid(const std::string &filename) {
+    FILE *f = fopen(filename.c_str(), "r");
+    if (!f) {
+        return false;
+    }
+    Header h;
+    bool ok = read_header(f, get_file_size(f), h) == nullptr;
+    fclose(f);
+    return ok;
+}
+
+} // namespace faiss
@@ -0,0 +1,93 @@
+#ifndef CONANN_CACHE_FILE_H
+#define CONANN_CACHE_FILE_H
+
+#include <faiss/ConannPredictions.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace faiss {
+
+/** Single-file cache of the ConANN calibration sweep, opened with mmap.
+ *
+ * Layout (host byte order, sections aligned on 64 bytes):
+ *
+ *   header   ConannCacheFile::Header (magic, version, sizes, section offsets)
+ *   nonconf  nq * nlist floats, query-major, indexed by probe rank
+ *   offsets  nq + 1 idx_t, see ConannPredictionsView
+ *   entries  n_entries ConannTopkEntry
+ *
+ * Reading maps the file read-only: the predictions are used in place
+ * through views, nothing is parsed or copied at open time.
+ */
+struct ConannCacheFile {
+    static constexpr uint32_t current_version = 3;
+
+    struct Header {
+        char magic[4];        ///< "CNNC"
+        uint32_t version;     ///< current_version when written
+        uint64_t entry_size;  ///< sizeof(ConannTopkEntry) when written
+        uint64_t fingerprint; ///< IndexIVF::conann_fingerprint of the inputs
+        uint64_t nq;
+        uint64_t nlist;
+        uint64_t k;
+        uint64_t n_entries;
+        uint64_t nonconf_offset; ///< byte offsets of the sections
+        uint64_t offsets_offset;
+        uint64_t entries_offset;
+        uint64_t total_size; ///< expected file size
+    };
+
+    std::string filename;
+    Header header;
+
+    const float *nonconf = nullptr;
+    const idx_t *offsets = nullptr;
+    const ConannTopkEntry *entries = nullptr;
+
+    /// map an existing cache file, throws if it is missing, truncated or
+    /// written by another version
+    explicit ConannCacheFile(const std::string &filename);
+
+    ConannCacheFile(const ConannCacheFile &) = delete;
+    ConannCacheFile &operator=(const ConannCacheFile &) = delete;
+
+    ~ConannCacheFile();
+
+    size_t nq() const { return header.nq; }
+    size_t nlist() const { return header.nlist; }
+    size_t k() const { return header.k; }
+    uint64_t fingerprint() const { return header.fingerprint; }
+
+    /// scores of query q after each probe step (nlist floats)
+    const float *nonconf_row(size_t q) const {
+        return nonconf + q * header.nlist;
+    }
+
+    /// predictions of all the queries, pointing into the mapping
+    ConannPredictionsView preds_view() const {
+        return ConannPredictionsView(offsets, entries, header.nq,
+                                     header.nlist, header.k);
+    }
+
+    /** write a cache file. The file is written under a temporary name and
+     * renamed, so a concurrent reader never maps a partial file.
+     *
+     * @param nonconf  nq vectors of nlist scores
+     */
+    static void write(const std::string &filename, uint64_t fingerprint,
+                      const std::vector<std::vector<float>> &nonconf,
+                      const ConannPredictions &preds);
+
+    /// true if filename exists and has a valid header for this version
+    static bool is_valid(const std::string &filename);
+
+  private:
+    void *ptr = nullptr;
+    size_t totsize = 0;
+};
+
+} // namespace faiss
+
+#endif // CONANN_CACHE_FILE_H
@@ -0,0 +1,276 @@
+#include <faiss/ConannHNSW.h>
+
+#include <faiss/IndexIVF.h>
+#include <faiss/impl/AuxIndexStructures.h>
+#include <faiss/impl/DistanceComputer.h>
+#include <faiss/impl/FaissAssert.h>
+#include <faiss/impl/ResultHandler.h>
+#include <faiss/utils/Heap.h>
+
+#include <omp.h>
+
+#include <algorithm>
+#include <memory>
+#include <unordered_set>
+
+namespace faiss {
+
+namespace {
+
+using C = HNSW::C;
+
+/// top-k heap of one query, flags whether it changed since the last step
+struct ConannTopkHandler : ResultHandler<C> {
+    int k;
+    std::vector<float> simi;
+    std::vector<idx_t> idxi;
+    bool changed = false;
+
+    explicit ConannTopkHandler(int k) : k(k), simi(k), idxi(k) {
+        heap_heapify<C>(k, simi.data(), idxi.data());
+    }
+
+    bool add_result(float dis, idx_t idx) override {
+        if (!C::cmp(threshold, dis)) {
+            return false;
+        }
+        heap_replace_top<C>(k, simi.data(), idxi.data(), dis, idx);
+        threshold = simi[0];
+        changed = true;
+        return true;
+    }
+};
+
+/// greedy descent of the upper levels, then level-0 search under observer
+void search_one(const IndexHNSW &index, int efSearch, const float *x,
+                ConannTopkHandler &res, VisitedTable &vt, HNSWStats &stats,
+                HNSWStepObserver &observer) {
+    const HNSW &hnsw = index.hnsw;
+    if (hnsw.entry_point == -1) {
+        return;
+    }
+    std::unique_ptr<DistanceComputer> qdis(
+        index.storage->get_distance_computer());
+    qdis->set_query(x);
+
+    HNSW::storage_idx_t nearest = hnsw.entry_point;
+    float d_nearest = (*qdis)(nearest);
+    for (int level = hnsw.max_level; level >= 1; level--) {
+        stats.combine(
+            greedy_update_nearest(hnsw, *qdis, level, nearest, d_nearest));
+    }
+
+    SearchParametersHNSW params;
+    params.efSearch = std::max(efSearch, res.k);
+    HNSW::MinimaxHeap candidates(params.efSearch);
+    candidates.push(nearest, d_nearest);
+    search_from_candidates(hnsw, *qdis, res, candidates, vt, stats, 0, 0,
+                           &params, &observer);
+    vt.advance();
+}
+
+} // namespace
+
+ConannHNSW::ConannHNSW(const IndexHNSW *index, int efSearch, int step_size,
+                       int n_steps, float max_distance)
+    : index(index), efSearch(efSearch), step_size(step_size),
+      n_steps(n_steps), MAX_DISTANCE(max_distance) {
+    FAISS_THROW_IF_NOT(index && index->storage);
+    FAISS_THROW_IF_NOT_MSG(index->metric_type == METRIC_L2,
+                           "ConannHNSW only supports METRIC_L2");
+    FAISS_THROW_IF_NOT(efSearch > 0 && step_size > 0 && n_steps > 0);
+    FAISS_THROW_IF_NOT(max_distance > 0);
+}
+
+float ConannHNSW::step_score(float nonconf, int step) const {
+    return ((1 - nonconf) + reg_lambda * step) / (1 + reg_lambda * n_steps);
+}
+
+std::tuple<std::vector<std::vector<float>>, ConannPredictions>
+ConannHNSW::compute_scores(int k, idx_t n, const float *x) const {
+    FAISS_THROW_IF_NOT(k > 0);
+    std::vector<std::vector<float>> nonconf(n);
+    std::vector<std::vector<ConannTopkEntry>> logs(n);
+
+    // records the top-k before each step, over the full budget
+    struct RecordingObserver : HNSWStepObserver {
+        const ConannHNSW &conann;
+        ConannTopkHandler &res;
+        std::vector<float> &kth_before;
+        std::vector<ConannTopkEntry> &log;
+        ConannTopkRecorder recorder;
+        int last_step = -1; ///< last step started
+
+        RecordingObserver(const ConannHNSW &conann, ConannTopkHandler &res,
+                          std::vector<float> &kth_before,
+                          std::vector<ConannTopkEntry> &log)
+            : conann(conann), res(res), kth_before(kth_before), log(log) {
+            step_size = conann.step_size;
+        }
+
+        void record(int step) {
+            recorder.record(step, res.k, res.simi.data(), res.idxi.data(),
+                            conann.n_steps, log);
+            res.changed = false;
+        }
+
+        bool before_step(int step, float threshold) override {
+            if (step >= 1 && res.changed) {
+                record(step - 1);
+            }
+            last_step = step;
+            if (step == conann.n_steps) {
+                return true;
+            }
+            kth_before[step] = threshold;
+            return false;
+        }
+    };
+
+    size_t n1 = 0, n2 = 0, ndis = 0, nhops = 0;
+#pragma omp parallel reduction(+ : n1, n2, ndis, nhops)
+    {
+        VisitedTable vt(index->ntotal);
+        std::vector<float> kth_before;
+        HNSWStats local_stats;
+
+#pragma omp for schedule(dynamic)
+        for (idx_t q = 0; q < n; q++) {
+            ConannTopkHandler res(k);
+            kth_before.resize(n_steps);
+            RecordingObserver observer(*this, res, kth_before, logs[q]);
+            local_stats.reset();
+            search_one(*index, efSearch, x + q * index->d, res, vt,
+                       local_stats, observer);
+
+            // the search ran out of candidates before the budget: the later
+            // steps keep the final top-k
+            if (res.changed) {
+                observer.record(std::max(
+                    0, std::min(observer.last_step, n_steps - 1)));
+            }
+            for (int i = observer.last_step + 1; i < n_steps; i++) {
+                kth_before[i] = res.threshold;
+            }
+
+            nonconf[q].resize(n_steps);
+            for (int i = 0; i < n_steps; i++) {
+                nonconf[q][i] = std::min(kth_before[i] / MAX_DISTANCE, 1.0f);
+            }
+            n1 += local_stats.n1;
+            n2 += local_stats.n2;
+            ndis += local_stats.ndis;
+            nhops += local_stats.nhops;
+        }
+    }
+    hnsw_stats.n1 += n1;
+    hnsw_stats.n2 += n2;
+    hnsw_stats.ndis += ndis;
+    hnsw_stats.nhops += nhops;
+
+    return std::make_tuple(std::move(nonconf),
+                           ConannPredictions(n_steps, k, logs));
+}
+
+float ConannHNSW::calibrate(float alpha, int k, idx_t n, const float *x,
+                            const idx_t *gt) {
+    FAISS_THROW_IF_NOT(alpha > 0 && alpha < 1);
+    FAISS_THROW_IF_NOT(n > 0);
+    K = k;
+
+    auto [nonconf, preds] = compute_scores(k, n, x);
+    ConannPredictionsView view = preds.view();
+
+    IndexIVF::FnrStepFunction sf;
+    sf.nq = n;
+    sf.nlist = n_steps;
+    sf.k = k;
+    sf.scores.resize(n * n_steps);
+    sf.hits.resize(n * n_steps);
+    for (idx_t q = 0; q < n; q++) {
+        for (idx_t j = 0; j < k; j++) {
+            sf.total_gt += gt[q * k + j] >= 0;
+        }
+    }
+
+#pragma omp parallel
+    {
+        std::vector<idx_t> topk(k);
+        std::unordered_set<idx_t> gt_q;
+
+#pragma omp for
+        for (idx_t q = 0; q < n; q++) {
+            gt_q.clear();
+            for (idx_t j = 0; j < k; j++) {
+                if (gt[q * k + j] >= 0) {
+                    gt_q.insert(gt[q * k + j]);
+                }
+            }
+            for (int i = 0; i < n_steps; i++) {
+                // the score only increases along the search: the row is
+                // already sorted
+                sf.scores[q * n_steps + i] = step_score(nonconf[q][i], i);
+                size_t nres = view.reconstruct(q, i, topk.data());
+                int32_t h = 0;
+                for (size_t j = 0; j < nres; j++) {
+                    h += gt_q.count(topk[j]);
+                }
+                sf.hits[q * n_steps + i] = h;
+            }
+        }
+    }
+
+    lamhat = sf.min_admissible_lambda(IndexIVF::conformal_target_fnr(alpha, n));
+    return lamhat;
+}
+
+void ConannHNSW::search(idx_t n, const float *x, float *distances,
+                        idx_t *labels) const {
+    FAISS_THROW_IF_NOT_MSG(K > 0, "ConannHNSW is not calibrated");
+
+    // stops before the first step whose score exceeds lamhat
+    struct StopObserver : HNSWStepObserver {
+        const ConannHNSW &conann;
+
+        explicit StopObserver(const ConannHNSW &conann) : conann(conann) {
+            step_size = conann.step_size;
+        }
+
+        bool before_step(int step, float threshold) override {
+            if (step == conann.n_steps) {
+                return true;
+            }
+            float nonconf = std::min(threshold / conann.MAX_DISTANCE, 1.0f);
+            return conann.step_score(nonconf, step) > conann.lamhat;
+        }
+    };
+
+    size_t n1 = 0, n2 = 0, ndis = 0, nhops = 0;
+#pragma omp parallel reduction(+ : n1, n2, ndis, nhops)
+    {
+        VisitedTable vt(index->ntotal);
+        StopObserver observer(*this);
+        HNSWStats local_stats;
+
+#pragma omp for schedule(dynamic)
+        for (idx_t q = 0; q < n; q++) {
+            ConannTopkHandler res(K);
+            local_stats.reset();
+            search_one(*index, efSearch, x + q * index->d, res, vt,
+                       local_stats, observer);
+            heap_reorder<C>(K, res.simi.data(), res.idxi.data());
+            std::copy(res.simi.begin(), res.simi.end(), distances + q * K);
+            std::copy(res.idxi.begin(), res.idxi.end(), labels + q * K);
+            n1 += local_stats.n1;
+            n2 += local_stats.n2;
+            ndis += local_stats.ndis;
+            nhops += local_stats.nhops;
+        }
+    }
+    hnsw_stats.n1 += n1;
+    hnsw_stats.n2 += n2;
+    hnsw_stats.ndis += ndis;
+    hnsw_stats.nhops += nhops;
+}
+
+} // namespace faiss
@@ -0,0 +1,70 @@
+#ifndef CONANN_HNSW_H
+#define CONANN_HNSW_H
+
+#include <faiss/ConannPredictions.h>
+#include <faiss/IndexHNSW.h>
+
+#include <tuple>
+#include <vector>
+
+namespace faiss {
+
+/** Conformal early termination of the HNSW search.
+ *
+ * The level-0 beam search of a query is cut into steps of step_size node
+ * expansions, at most n_steps of them (the search budget). Before step i the
+ * k-th distance of the current results gives the nonconformity score
+ * min(kth_dis / MAX_DISTANCE, 1), and the search stops when
+ *
+ *     ((1 - nonconf) + reg_lambda * i) / (1 + reg_lambda * n_steps) > lamhat
+ *
+ * returning the results of step i - 1. The score does not decrease along the
+ * search, so lamhat is calibrated as for IndexIVF (the steps play the role
+ * of the probed clusters): calibrate() records the top-k trajectory of the
+ * calibration queries over the steps and picks the smallest lamhat whose
+ * conformal FNR bound holds for alpha.
+ *
+ * Only METRIC_L2 storages are supported.
+ */
+struct ConannHNSW {
+    const IndexHNSW *index; ///< not owned
+    int efSearch;           ///< beam width of the level-0 search
+    int step_size;          ///< node expansions per step
+    int n_steps;            ///< max nb of steps per query
+    float MAX_DISTANCE;
+    float reg_lambda = 0;
+
+    int K = 0;        ///< nb of results, set by calibrate
+    float lamhat = 2; ///< > 1: no early termination (full budget)
+
+    ConannHNSW(const IndexHNSW *index, int efSearch, int step_size,
+               int n_steps, float max_distance);
+
+    /// regularized score before step `step`, same float operations in the
+    /// calibration and in the search
+    float step_score(float nonconf, int step) const;
+
+    /** nonconformity scores before each step (nq * n_steps) and the top-k
+     * changelog over the steps (step i: after i + 1 steps), with the full
+     * budget
+     */
+    std::tuple<std::vector<std::vector<float>>, ConannPredictions>
+    compute_scores(int k, idx_t n, const float *x) const;
+
+    /** set K and lamhat for the risk level alpha
+     *
+     * @param x   calibration queries, size n * d
+     * @param gt  their ground-truth ids, size n * k
+     * @return    lamhat (1 if no lambda is admissible)
+     */
+    float calibrate(float alpha, int k, idx_t n, const float *x,
+                    const idx_t *gt);
+
+    /// search with the early termination of lamhat, n * K results
+    void search(idx_t n, const float *x, float *distances,
+                idx_t *labels) const;
+};
+
+} // namespace faiss
+
+#endif // CONANN_HNSW_H
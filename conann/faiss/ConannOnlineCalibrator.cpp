@@ -0,0 +1,150 @@
+#include <faiss/ConannOnlineCalibrator.h>
+
+#include <faiss/impl/FaissAssert.h>
+
+namespace faiss {
+
+ConannOnlineCalibrator::ConannOnlineCalibrator(const IndexIVF *index,
+                                               float alpha,
+                                               size_t window_size, int kreg,
+                                               float reg_lambda)
+    : index(index), alpha(alpha), window_size(window_size), kreg(kreg),
+      reg_lambda(reg_lambda) {
+    FAISS_THROW_IF_NOT(index);
+    FAISS_THROW_IF_NOT_MSG(index->K > 0, "index->K is not set");
+    FAISS_THROW_IF_NOT(alpha > 0 && alpha < 1);
+}
+
+ConannOnlineCalibrator::ConannOnlineCalibrator(const IndexIVF *index,
+                                               float alpha,
+                                               size_t window_size)
+    : ConannOnlineCalibrator(index, alpha, window_size,
+                             index->calibration.kreg,
+                             index->calibration.regLambda) {
+    FAISS_THROW_IF_NOT_MSG(index->is_calibrated, "index is not calibrated");
+}
+
+void ConannOnlineCalibrator::add(size_t n, const float *x, const idx_t *gt) {
+    std::lock_guard<std::mutex> lock(add_mutex);
+    if (n == 0) {
+        return;
+    }
+    size_t k = index->K;
+
+    // batch-only sweep, reduced to the hits breakpoints of each query
+    auto [nonconf, preds] = index->compute_scores(
+        IndexIVF::CalibrationResults{10, 0, 0}, n, x);
+    std::vector<std::vector<idx_t>> labels(n);
+    for (size_t q = 0; q < n; q++) {
+        labels[q].assign(gt + q * k, gt + (q + 1) * k);
+    }
+    IndexIVF::GtHits hits = index->compute_gt_hits(labels, preds.view());
+    auto reg_nonconf = index->regularize_scores(
+        nonconf, index->compute_sorted_indices(nonconf), reg_lambda, kreg);
+    IndexIVF::FnrStepFunction sf =
+        index->compute_fnr_step_function(reg_nonconf, hits);
+
+    for (size_t q = 0; q < n; q++) {
+        WindowQuery wq;
+        wq.n_gt = labels[q].size();
+        // same breakpoints as FnrStepFunction::min_admissible_lambda
+        int32_t prev_hits = 0;
+        for (size_t i = 0; i < sf.nlist; i++) {
+            int32_t h = sf.hits[q * sf.nlist + i];
+            if (h != prev_hits) {
+                wq.events.emplace_back(sf.scores[q * sf.nlist + i],
+                                       h - prev_hits);
+                prev_hits = h;
+            }
+        }
+        wq.nonconf = std::move(nonconf[q]);
+        insert_query(std::move(wq));
+    }
+    while (window_size > 0 && window.size() > window_size) {
+        evict_query();
+    }
+
+    IndexIVF::CalibrationResults params{compute_lamhat(), kreg, reg_lambda};
+    publish(params);
+}
+
+void ConannOnlineCalibrator::insert_query(WindowQuery &&wq) {
+    for (const auto &ev : wq.events) {
+        breakpoints[ev.first] += ev.second;
+    }
+    total_gt += wq.n_gt;
+    window.push_back(std::move(wq));
+}
+
+void ConannOnlineCalibrator::evict_query() {
+    const WindowQuery &wq = window.front();
+    for (const auto &ev : wq.events) {
+        // other queries may still have a breakpoint at this score, an entry
+        // is dropped when no hits change remains
+        int64_t &delta = breakpoints[ev.first];
+        delta -= ev.second;
+        if (delta == 0) {
+            breakpoints.erase(ev.first);
+        }
+    }
+    total_gt -= wq.n_gt;
+    window.pop_front();
+}
+
+float ConannOnlineCalibrator::compute_lamhat() const {
+    float target_fnr = IndexIVF::conformal_target_fnr(alpha, window.size());
+    // same sweep as FnrStepFunction::min_admissible_lambda, over the merged
+    // breakpoints of the window
+    if (total_gt == 0 || target_fnr >= 1.0f) {
+        return 0.0f;
+    }
+    int64_t sum_hits = 0;
+    for (const auto &bp : breakpoints) {
+        sum_hits += bp.second;
+        float fnr = 1.0f - static_cast<float>(sum_hits) / total_gt;
+        if (fnr <= target_fnr) {
+            return bp.first;
+        }
+    }
+    return 1.0f;
+}
+
+void ConannOnlineCalibrator::publish(
+    const IndexIVF::CalibrationResults &params_in) {
+    auto snap = std::make_shared<Snapshot>();
+    snap->params = params_in;
+    std::vector<int> counts;
+    counts.reserve(window.size());
+    for (const auto &wq : window) {
+        counts.push_back(index->compute_probe_count(params_in, wq.nonconf));
+    }
+    index->set_probe_budgets(snap->params, std::move(counts));
+    snap->stop_thresholds = index->compile_stop_thresholds(snap->params);
+    snap->n_queries = window.size();
+    auto prev = snapshot();
+    snap->version = prev ? prev->version + 1 : 1;
+    std::atomic_store(&current,
+                      std::shared_ptr<const Snapshot>(std::move(snap)));
+}
+
+std::shared_ptr<const ConannOnlineCalibrator::Snapshot>
+ConannOnlineCalibrator::snapshot() const {
+    return std::atomic_load(&current);
+}
+
+void ConannOnlineCalibrator::search(idx_t n, const float *x, float *distances,
+                                    idx_t *labels) const {
+    auto snap = snapshot();
+    FAISS_THROW_IF_NOT_MSG(snap, "no calibration published yet");
+    SearchParametersConann params = index->conann_search_params(snap->params);
+    index->search_with_error_quantification(
+        snap->stop_thresholds.data(), n, x, index->K, distances, labels,
+        nullptr, nullptr, &params);
+}
+
+size_t ConannOnlineCalibrator::size() const {
+    std::lock_guard<std::mutex> lock(add_mutex);
+    return window.size();
+}
+
+} // namespace faiss
@@ -0,0 +1,98 @@
+#ifndef CONANN_ONLINE_CALIBRATOR_H
+#define CONANN_ONLINE_CALIBRATOR_H
+
+#include <faiss/IndexIVF.h>
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace faiss {
+
+/** Incremental ConANN calibration over a sliding window of labelled queries.
+ *
+ * Each batch passed to add() is scored once (a full nprobe = nlist sweep of
+ * the batch only) and reduced, per query, to the regularized scores at which
+ * its nb of ground-truth hits changes. The window keeps these breakpoints
+ * merged in an ordered map, so adding or evicting a query costs O(k log)
+ * and lamhat is recomputed by sweeping the merged breakpoints, without
+ * revisiting older queries.
+ *
+ * The regularization (kreg, reg_lambda) is fixed, typically taken from a
+ * previous IndexIVF::calibrate(). After each batch the new
+ * CalibrationResults and their stop thresholds are published as an
+ * immutable snapshot: searching threads load it atomically and are never
+ * blocked by add(). add() only reads the index (all the index methods it
+ * calls are const), but the index must not be modified meanwhile, and the
+ * global indexIVF_stats are updated without synchronization as for any
+ * IndexIVF search. lamhat is always the exact minimal admissible lambda
+ * (IndexIVF::exact_lamhat).
+ */
+struct ConannOnlineCalibrator {
+    /// published calibration, never modified once visible
+    struct Snapshot {
+        IndexIVF::CalibrationResults params;
+        std::vector<float> stop_thresholds; ///< compile_stop_thresholds
+        size_t n_queries = 0; ///< window size it was calibrated on
+        uint64_t version = 0; ///< incremented at each publication
+    };
+
+    const IndexIVF *index; ///< not owned, must be trained and filled
+    float alpha;
+    size_t window_size; ///< max nb of queries in the window, 0 = unbounded
+    int kreg;
+    float reg_lambda;
+
+    ConannOnlineCalibrator(const IndexIVF *index, float alpha,
+                           size_t window_size, int kreg, float reg_lambda);
+
+    /// start from the regularization of index->calibration
+    ConannOnlineCalibrator(const IndexIVF *index, float alpha,
+                           size_t window_size);
+
+    /** add n labelled queries, evict the oldest ones beyond window_size and
+     * publish the updated calibration. Calls are serialized.
+     *
+     * @param x   queries, size n * d
+     * @param gt  ground-truth ids, size n * index->K
+     */
+    void add(size_t n, const float *x, const idx_t *gt);
+
+    /// latest published calibration (nullptr before the first add)
+    std::shared_ptr<const Snapshot> snapshot() const;
+
+    /// search_conann with the latest published calibration, thread-safe
+    void search(idx_t n, const float *x, float *distances,
+                idx_t *labels) const;
+
+    /// nb of queries in the window
+    size_t size() const;
+
+  private:
+    struct WindowQuery {
+        std::vector<float> nonconf; ///< nonconformity scores, probe order
+        /// (regularized score, change of the nb of hits) breakpoints
+        std::vector<std::pair<float, int32_t>> events;
+        size_t n_gt;
+    };
+
+    void insert_query(WindowQuery &&wq);
+    void evict_query();
+    float compute_lamhat() const;
+    void publish(const IndexIVF::CalibrationResults &params);
+
+    mutable std::mutex add_mutex; ///< serializes the writers
+    std::deque<WindowQuery> window;
+    /// hits change per breakpoint, summed over the window
+    std::map<float, int64_t> breakpoints;
+    size_t total_gt = 0;
+
+    std::shared_ptr<const Snapshot> current;
+};
+
+} // namespace faiss
+
+#endif // CONANN_ONLINE_CALIBRATOR_H
@@ -0,0 +1,209 @@
+#ifndef CONANN_PREDICTIONS_H
+#define CONANN_PREDICTIONS_H
+
+#include <faiss/MetricType.h>
+#include <faiss/impl/FaissAssert.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace faiss {
+
+/** One neighbor of an incremental top-k result.
+ *
+ * The id is part of the query's top-k for the probe steps
+ * [first_step, last_step), where step j means "after the j+1 nearest
+ * clusters have been probed". Neighbors that are never evicted have
+ * last_step == nlist. dis is the distance (or similarity) to the query, so
+ * the top-k' trajectory for any k' <= k can be derived from the log.
+ */
+struct ConannTopkEntry {
+    idx_t id;
+    int32_t first_step;
+    int32_t last_step;
+    float dis;
+};
+
+/** Read-only view over a block of incremental top-k predictions.
+ *
+ * Rather than storing the full top-k after every probe step (nq * nlist * k
+ * ids), each query keeps a changelog of the neighbors that entered its
+ * top-k and the step at which they were evicted. This is O(k + insertions)
+ * per query, and the top-k at any step is recovered with reconstruct().
+ *
+ * Entries of query q are entries[offsets[q] .. offsets[q + 1]). Offsets are
+ * absolute, so a view over a range of queries only shifts the offsets
+ * pointer.
+ */
+struct ConannPredictionsView {
+    const idx_t *offsets = nullptr;           ///< size nq + 1
+    const ConannTopkEntry *entries = nullptr; ///< indexed by offsets
+    size_t nq = 0;
+    size_t nlist = 0;
+    size_t k = 0;
+
+    ConannPredictionsView() = default;
+    ConannPredictionsView(const idx_t *offsets, const ConannTopkEntry *entries,
+                          size_t nq, size_t nlist, size_t k)
+        : offsets(offsets), entries(entries), nq(nq), nlist(nlist), k(k) {}
+
+    size_t size() const { return nq; }
+
+    const ConannTopkEntry *begin(size_t q) const {
+        return entries + offsets[q];
+    }
+
+    const ConannTopkEntry *end(size_t q) const {
+        return entries + offsets[q + 1];
+    }
+
+    /** top-k ids of query q once probe step `step` is done (unordered)
+     *
+     * @param out  output ids, size >= k
+     * @return     nb of ids written (< k if fewer vectors were seen)
+     */
+    size_t reconstruct(size_t q, size_t step, idx_t *out) const {
+        size_t n = 0;
+        for (const ConannTopkEntry *e = begin(q); e != end(q); e++) {
+            if (e->first_step <= (int32_t)step && (int32_t)step < e->last_step) {
+                out[n++] = e->id;
+            }
+        }
+        return n;
+    }
+
+    /// view over queries [q0, q1)
+    ConannPredictionsView slice(size_t q0, size_t q1) const {
+        FAISS_THROW_IF_NOT(q0 <= q1 && q1 <= nq);
+        return ConannPredictionsView(offsets + q0, entries, q1 - q0, nlist, k);
+    }
+};
+
+/** Builds the changelog of one query while it is searched.
+ *
+ * record() is called after each probe step that changed the top-k: it diffs
+ * the result heap against the previous step, appends the new neighbors to
+ * the log and closes the evicted ones.
+ */
+struct ConannTopkRecorder {
+    /// ids currently in the top-k (sorted by id), paired with the index of
+    /// their entry in the log
+    std::vector<std::pair<idx_t, size_t>> cur, next;
+
+    /// start the changelog of a new query
+    void clear() { cur.clear(); }
+
+    void record(int32_t step, size_t k, const float *dis, const idx_t *ids,
+                size_t nlist, std::vector<ConannTopkEntry> &log) {
+        // second: position in the heap, then index in the log
+        next.clear();
+        for (size_t j = 0; j < k; j++) {
+            if (ids[j] >= 0) {
+                next.emplace_back(ids[j], j);
+            }
+        }
+        std::sort(next.begin(), next.end());
+
+        size_t a = 0;
+        for (auto &nx : next) {
+            while (a < cur.size() && cur[a].first < nx.first) {
+                log[cur[a++].second].last_step = step;
+            }
+            if (a < cur.size() && cur[a].first == nx.first) {
+                nx.second = cur[a++].second;
+            } else {
+                float d = dis[nx.second];
+                nx.second = log.size();
+                log.push_back({nx.first, step, (int32_t)nlist, d});
+            }
+        }
+        for (; a < cur.size(); a++) {
+            log[cur[a].second].last_step = step;
+        }
+        std::swap(cur, next);
+    }
+};
+
+/** Top-k heap of a query before the current probe, restored when the probe
+ * triggers the early stop. The copy is only refreshed before a probe when
+ * the previous one changed the heap, so that the probes that do not improve
+ * the top-k cost no copy. T, TI: types of the heap distances and ids.
+ */
+template <typename T, typename TI>
+struct ConannTopkSnapshot {
+    std::vector<T> dis;
+    std::vector<TI> ids;
+    bool stale = true;
+
+    explicit ConannTopkSnapshot(size_t k = 0) : dis(k), ids(k) {}
+
+    /// start a new query
+    void reset() { stale = true; }
+
+    /// before a probe
+    void save(size_t k, const T *heap_dis, const TI *heap_ids) {
+        if (stale) {
+            std::copy(heap_dis, heap_dis + k, dis.begin());
+            std::copy(heap_ids, heap_ids + k, ids.begin());
+            stale = false;
+        }
+    }
+
+    /// after a probe that did not stop the search
+    void update(bool heap_changed) { stale = stale || heap_changed; }
+
+    /// the probe stopped the search: back to the heap before it
+    void restore(size_t k, bool heap_changed, T *heap_dis,
+                 TI *heap_ids) const {
+        if (heap_changed) {
+            std::copy(dis.begin(), dis.begin() + k, heap_dis);
+            std::copy(ids.begin(), ids.begin() + k, heap_ids);
+        }
+    }
+};
+
+/// Owning store for incremental top-k predictions, compacted per query
+struct ConannPredictions {
+    size_t nq = 0;
+    size_t nlist = 0;
+    size_t k = 0;
+    std::vector<idx_t> offsets;           ///< size nq + 1
+    std::vector<ConannTopkEntry> entries; ///< all changelogs back to back
+
+    ConannPredictions() = default;
+
+    /// compact the per-query changelogs filled in during search
+    ConannPredictions(size_t nlist, size_t k,
+                      const std::vector<std::vector<ConannTopkEntry>> &per_query)
+        : nq(per_query.size()), nlist(nlist), k(k), offsets(nq + 1) {
+        offsets[0] = 0;
+        for (size_t q = 0; q < nq; q++) {
+            offsets[q + 1] = offsets[q] + per_query[q].size();
+        }
+        entries.reserve(offsets[nq]);
+        for (const auto &log : per_query) {
+            entries.insert(entries.end(), log.begin(), log.end());
+        }
+    }
+
+    /// take ownership of existing buffers (eg. read from the cache)
+    ConannPredictions(size_t nlist, size_t k, std::vector<idx_t> &&offsets_in,
+                      std::vector<ConannTopkEntry> &&entries_in)
+        : nlist(nlist), k(k), offsets(std::move(offsets_in)),
+          entries(std::move(entries_in)) {
+        FAISS_THROW_IF_NOT(!offsets.empty());
+        FAISS_THROW_IF_NOT(offsets.back() == (idx_t)entries.size());
+        nq = offsets.size() - 1;
+    }
+
+    ConannPredictionsView view() const {
+        return ConannPredictionsView(offsets.data(), entries.data(), nq, nlist,
+                                     k);
+    }
+};
+
+} // namespace faiss
+
+#endif // CONANN_PREDICTIONS_H
@@ -7,13 +7,14 @@
 
 // -*- c++ -*-
 
-#include <faiss/ConannCache.h>
+#include <faiss/ConannCacheFile.h>
 #include <faiss/IndexFlat.h>
 #include <faiss/IndexIVF.h>
 #include <faiss/impl/AuxIndexStructures.h>
 #include <faiss/impl/CodePacker.h>
 #include <faiss/impl/FaissAssert.h>
 #include <faiss/impl/IDSelector.h>
+#include <faiss/utils/distances.h>
 #include <faiss/utils/hamming.h>
 #include <faiss/utils/utils.h>
 #include <gsl/gsl_errno.h>
@@ -28,6 +29,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <ctime>
+#include <filesystem>
 #include <fstream>
 #include <functional>
 #include <iostream>
@@ -35,13 +37,30 @@
 #include <map>
 #include <memory>
 #include <mutex>
+#include <numeric>
 #include <random>
 #include <sys/time.h>
 #include <thread>
 #include <tuple>
+#include <typeinfo>
 #include <unordered_set>
 #include <vector>
 
+extern "C" {
+
+// this is to keep the clang syntax checker happy
+#ifndef FINTEGER
+#define FINTEGER int
+#endif
+
+/* declare BLAS functions, see http://www.netlib.org/clapack/cblas/ */
+
+int sgemm_(const char *transa, const char *transb, FINTEGER *m, FINTEGER *n,
+           FINTEGER *k, const float *alpha, const float *a, FINTEGER *lda,
+           const float *b, FINTEGER *ldb, float *beta, float *c,
+           FINTEGER *ldc);
+}
+
 namespace faiss {
 
 using ScopedIds = InvertedLists::ScopedIds;
@@ -1096,33 +1115,173 @@ void IndexIVF::train(idx_t n, const float *x) {
     is_trained = true;
 }
 
+namespace {
+
+/* refine_index is addressed with the labels of the inverted lists, as in
+ * IndexRefine: it must hold ntotal vectors, and the lists the sequential
+ * ids 0..ntotal-1, each once. */
+void check_refine_ids(const IndexIVF &ivf) {
+    FAISS_THROW_IF_NOT_FMT(ivf.refine_index->ntotal == ivf.ntotal,
+                           "refine_index has %" PRId64
+                           " vectors, the index %" PRId64,
+                           ivf.refine_index->ntotal, ivf.ntotal);
+    std::vector<bool> seen(ivf.ntotal);
+    for (size_t l = 0; l < ivf.nlist; l++) {
+        size_t ls = ivf.invlists->list_size(l);
+        if (ls == 0) {
+            continue;
+        }
+        InvertedLists::ScopedIds ids(ivf.invlists, l);
+        for (size_t j = 0; j < ls; j++) {
+            idx_t id = ids[j];
+            FAISS_THROW_IF_NOT_FMT(id >= 0 && id < ivf.ntotal && !seen[id],
+                                   "id %" PRId64
+                                   " of list %zd is not a sequential id, "
+                                   "refine_index cannot be addressed with it",
+                                   id, l);
+            seen[id] = true;
+        }
+    }
+}
+
+} // namespace
+
+uint64_t IndexIVF::conann_fingerprint(const float *queries, size_t nq) const {
+    std::vector<uint64_t> parts;
+
+    // hash_bytes reads the first byte even when n == 0
+    auto hash_floats = [](const float *x, size_t n) {
+        return n == 0 ? 0 : hash_bytes((const uint8_t *)x, n * sizeof(float));
+    };
+
+    // scalars the scores depend on
+    parts.push_back(metric_type);
+    parts.push_back(d);
+    parts.push_back(nlist);
+    parts.push_back(K);
+    parts.push_back(nq);
+    parts.push_back(ntotal);
+    parts.push_back(code_size);
+    float max_distance = MAX_DISTANCE;
+    uint32_t max_distance_bits;
+    std::memcpy(&max_distance_bits, &max_distance, sizeof(max_distance_bits));
+    parts.push_back(max_distance_bits);
+    if (refine_index) {
+        // the scores are the refined distances of the shortlist: the type
+        // and the content of refine_index matter, not only its size
+        parts.push_back(refine_index->ntotal);
+        parts.push_back(refine_index->d);
+        parts.push_back(refine_index->metric_type);
+        uint32_t k_factor_bits;
+        std::memcpy(&k_factor_bits, &refine_k_factor, sizeof(k_factor_bits));
+        parts.push_back(k_factor_bits);
+        const char *type_name = typeid(*refine_index).name();
+        parts.push_back(
+            hash_bytes((const uint8_t *)type_name, std::strlen(type_name)));
+        auto flat_codes = dynamic_cast<const IndexFlatCodes *>(refine_index);
+        if (flat_codes) {
+            parts.push_back(flat_codes->code_size);
+            parts.push_back(
+                flat_codes->codes.empty()
+                    ? 0
+                    : hash_bytes(flat_codes->codes.data(),
+                                 flat_codes->codes.size()));
+        } else {
+            // other index types: hash what they reconstruct, by blocks
+            const idx_t bs = 4096;
+            std::vector<float> buf;
+            std::vector<uint64_t> block_hashes;
+            for (idx_t i0 = 0; i0 < refine_index->ntotal; i0 += bs) {
+                idx_t ni = std::min(bs, refine_index->ntotal - i0);
+                buf.resize(ni * refine_index->d);
+                refine_index->reconstruct_n(i0, ni, buf.data());
+                block_hashes.push_back(hash_floats(buf.data(), buf.size()));
+            }
+            if (!block_hashes.empty()) {
+                parts.push_back(
+                    hash_bytes((const uint8_t *)block_hashes.data(),
+                               block_hashes.size() * sizeof(uint64_t)));
+            }
+        }
+    }
+
+    // centroids
+    std::vector<float> centroids_buf(nlist * d);
+    quantizer->reconstruct_n(0, nlist, centroids_buf.data());
+    parts.push_back(hash_floats(centroids_buf.data(), centroids_buf.size()));
+
+    // inverted list sizes
+    std::vector<uint64_t> list_sizes(nlist);
+    for (size_t i = 0; i < nlist; i++) {
+        list_sizes[i] = invlists->list_size(i);
+    }
+    parts.push_back(hash_bytes((const uint8_t *)list_sizes.data(),
+                               list_sizes.size() * sizeof(uint64_t)));
+
+    // query block, hashed per query in parallel
+    std::vector<uint64_t> query_hashes(nq);
+#pragma omp parallel for if (nq > 1000)
+    for (int64_t i = 0; i < (int64_t)nq; i++) {
+        query_hashes[i] = hash_floats(queries + i * d, d);
+    }
+    if (nq > 0) {
+        parts.push_back(hash_bytes((const uint8_t *)query_hashes.data(),
+                                   query_hashes.size() * sizeof(uint64_t)));
+    }
+
+    return hash_bytes((const uint8_t *)parts.data(),
+                      parts.size() * sizeof(uint64_t));
+}
+
 void IndexIVF::prep_execution(float alpha, float calib_sz, float tune_sz,
                               const float *queries, size_t nq,
                               const faiss::idx_t *gt) {
+    if (refine_index) {
+        check_refine_ids(*this);
+    }
 
     std::cout << "Starting to prep execution: " << std::endl;
 
-    // The nonconformity scores assigned to all clusters per query (nq * nlist).
+    // The nonconformity scores after each probe step per query (nq * nlist),
+    // when they are computed. On a cache hit they are read from the mapping.
     std::vector<std::vector<float>> all_nonconf_scores;
-    // The predicted vector ids of all K neighbors for each query for increasing
-    // nprobe values. This stores all incremental search results as nprobe is
-    // increased from 1 to nlist. shape: nq * nlist * k
-    std::vector<std::vector<std::vector<faiss::idx_t>>> all_preds;
-
-    std::string cacheKeyNonConf{dataset_name + "_" + std::to_string(n_list) +
-                                "_" + std::to_string(K) + "_" +
-                                "nonconf_scores"};
-    std::string cacheKeyAllPreds{dataset_name + "_" + std::to_string(n_list) +
-                                 "_" + std::to_string(K) + "_" + "all_preds"};
-    if (enable_cache && conann_cache::check_cached_file(cacheKeyNonConf) &&
-        conann_cache::check_cached_file(cacheKeyAllPreds)) {
-        all_nonconf_scores =
-            conann_cache::read_from_cache<std::vector<std::vector<float>>>(
-                cacheKeyNonConf);
-        all_preds = conann_cache::read_from_cache<
-            std::vector<std::vector<std::vector<faiss::idx_t>>>>(
-            cacheKeyAllPreds);
-    } else {
+    ConannPredictionsView preds;
+
+    uint64_t fingerprint = enable_cache ? conann_fingerprint(queries, nq) : 0;
+    char fingerprint_hex[17];
+    snprintf(fingerprint_hex, sizeof(fingerprint_hex), "%016" PRIx64,
+             fingerprint);
+    std::string cache_filename{"./conann-cache/" + dataset_name + "_" +
+                               std::to_string(n_list) + "_" +
+                               std::to_string(K) + "_" + fingerprint_hex +
+                               ".cnnc"};
+    cache_file.reset();
+    if (enable_cache && ConannCacheFile::is_valid(cache_filename)) {
+        auto file = std::make_shared<const ConannCacheFile>(cache_filename);
+        if (file->fingerprint() == fingerprint && file->nq() == nq &&
+            file->nlist() == (size_t)n_list && file->k() == (size_t)K) {
+            cache_file = file;
+            all_preds = ConannPredictions();
+            preds = cache_file->preds_view();
+        } else {
+            std::cout << "Ignoring ConANN cache " << cache_filename
+                      << ": computed for other inputs" << std::endl;
+        }
+    }
+
+    // without gt, the ground truth is the top-k of the nprobe = nlist sweep
+    const bool fused_gt = gt == nullptr;
+    if (fused_gt) {
+        std::cout << "Using the exhaustive sweep as ground truth" << std::endl;
+    }
+
+    const bool streaming = !cache_file && calibration_block_size > 0;
+    if (streaming && enable_cache) {
+        std::cout << "Streaming calibration, the ConANN cache is not written"
+                  << std::endl;
+    }
+
+    if (!cache_file && !streaming) {
         double t1 = elapsed();
         // NOTE: pass lamhat > 1 here to make sure all scores get computed
         // using std::tie in this instance is really important for performance
@@ -1136,15 +1295,60 @@ void IndexIVF::prep_execution(float alpha, float calib_sz, float tune_sz,
                   << std::endl;
 
         if (enable_cache) {
-            conann_cache::write_to_cache(cacheKeyNonConf, all_nonconf_scores);
-            conann_cache::write_to_cache(cacheKeyAllPreds, all_preds);
+            std::filesystem::create_directory("./conann-cache");
+            ConannCacheFile::write(cache_filename, fingerprint,
+                                   all_nonconf_scores, all_preds);
         }
+        preds = all_preds.view();
     }
 
+    // scores of queries [q0, q1), moved out of all_nonconf_scores or copied
+    // from the mapped cache. The splits own their rows: the calibration
+    // consumes them as vectors and the multi-k calibration replaces them, so
+    // they are copied (nq * nlist floats). The predictions, the larger part
+    // of the cache, stay views into the mapping.
+    auto take_nonconf = [&](size_t q0, size_t q1) {
+        std::vector<std::vector<float>> out(q1 - q0);
+        for (size_t q = q0; q < q1; q++) {
+            if (cache_file) {
+                const float *row = cache_file->nonconf_row(q);
+                out[q - q0].assign(row, row + n_list);
+            } else {
+                out[q - q0] = std::move(all_nonconf_scores[q]);
+            }
+        }
+        return out;
+    };
+
+    // streaming mode: score queries [q0, q1) block by block, keep their
+    // scores and ground-truth hits and drop the predictions of each block
+    auto stream_split = [&](size_t q0, size_t q1,
+                            std::vector<std::vector<idx_t>> &labels,
+                            std::vector<std::vector<float>> &nonconf,
+                            GtHits &hits) {
+        double t1 = elapsed();
+        nonconf.clear();
+        nonconf.reserve(q1 - q0);
+        hits = GtHits();
+        for (size_t b0 = q0; b0 < q1; b0 += calibration_block_size) {
+            size_t b1 = std::min(q1, b0 + calibration_block_size);
+            auto [block_nonconf, block_preds] = compute_scores(
+                CalibrationResults{10, 0, 0}, b1 - b0, queries + b0 * d);
+            if (fused_gt) {
+                sweep_ground_truth(block_preds.view(), labels, b0 - q0);
+            }
+            hits.append(compute_gt_hits(labels, block_preds.view(), b0 - q0));
+            for (auto &row : block_nonconf) {
+                nonconf.push_back(std::move(row));
+            }
+        }
+        return elapsed() - t1;
+    };
+
     double t1 = elapsed();
     // slice computed data and store on index
-    // NOTE: This coping can become quite expensive but should still be worth it
-    // in combination with caching
+    // NOTE: predictions are sliced as views into all_preds; only the query
+    // vectors, labels and nonconformity scores are copied
     size_t calib_nq = size_t(calib_sz * nq);
     size_t tune_nq = size_t(tune_sz * nq);
     size_t test_nq = nq - calib_nq - tune_nq;
@@ -1165,15 +1369,24 @@ void IndexIVF::prep_execution(float alpha, float calib_sz, float tune_sz,
         calib_cx[i].resize(d);
         std::memcpy(calib_cx[i].data(), queries + i * d, d * sizeof(float));
 
-        calib_labels[i].resize(K);
-        std::memcpy(calib_labels[i].data(), gt + i * K,
-                    K * sizeof(faiss::idx_t));
+        if (!fused_gt) {
+            calib_labels[i].resize(K);
+            std::memcpy(calib_labels[i].data(), gt + i * K,
+                        K * sizeof(faiss::idx_t));
+        }
+    }
+    if (streaming) {
+        time_report.computeScoresCalib =
+            stream_split(0, calib_nq, calib_labels, calib_nonconf, calib_hits);
+        calib_preds = ConannPredictionsView();
+    } else {
+        calib_nonconf = take_nonconf(0, calib_nq);
+        calib_preds = preds.slice(0, calib_nq);
+        if (fused_gt) {
+            sweep_ground_truth(calib_preds, calib_labels);
+        }
+        calib_hits = compute_gt_hits(calib_labels, calib_preds);
     }
-    calib_nonconf = std::vector<std::vector<float>>(
-        all_nonconf_scores.begin(), all_nonconf_scores.begin() + calib_nq);
-
-    calib_preds = std::vector<std::vector<std::vector<faiss::idx_t>>>(
-        all_preds.begin(), all_preds.begin() + calib_nq);
 
     // Copy tuning data
     for (size_t i = 0; i < tune_nq; ++i) {
@@ -1181,15 +1394,24 @@ void IndexIVF::prep_execution(float alpha, float calib_sz, float tune_sz,
         std::memcpy(tune_cx[i].data(), queries + (i + calib_nq) * d,
                     d * sizeof(float));
 
-        tune_labels[i].resize(K);
-        std::memcpy(tune_labels[i].data(), gt + (i + calib_nq) * K,
-                    K * sizeof(faiss::idx_t));
+        if (!fused_gt) {
+            tune_labels[i].resize(K);
+            std::memcpy(tune_labels[i].data(), gt + (i + calib_nq) * K,
+                        K * sizeof(faiss::idx_t));
+        }
+    }
+    if (streaming) {
+        time_report.computeScoresTune = stream_split(
+            calib_nq, calib_nq + tune_nq, tune_labels, tune_nonconf, tune_hits);
+        tune_preds = ConannPredictionsView();
+    } else {
+        tune_nonconf = take_nonconf(calib_nq, calib_nq + tune_nq);
+        tune_preds = preds.slice(calib_nq, calib_nq + tune_nq);
+        if (fused_gt) {
+            sweep_ground_truth(tune_preds, tune_labels);
+        }
+        tune_hits = compute_gt_hits(tune_labels, tune_preds);
     }
-    tune_nonconf = std::vector<std::vector<float>>(
-        all_nonconf_scores.begin() + calib_nq,
-        all_nonconf_scores.begin() + calib_nq + tune_nq);
-    tune_preds = std::vector<std::vector<std::vector<faiss::idx_t>>>(
-        all_preds.begin() + calib_nq, all_preds.begin() + calib_nq + tune_nq);
 
     // Copy testing data
     for (size_t i = 0; i < test_nq; ++i) {
@@ -1197,45 +1419,61 @@ void IndexIVF::prep_execution(float alpha, float calib_sz, float tune_sz,
         std::memcpy(test_cx[i].data(), queries + (i + calib_nq + tune_nq) * d,
                     d * sizeof(float));
 
-        test_labels[i].resize(K);
-        std::memcpy(test_labels[i].data(), gt + (i + calib_nq + tune_nq) * K,
-                    K * sizeof(faiss::idx_t));
+        if (!fused_gt) {
+            test_labels[i].resize(K);
+            std::memcpy(test_labels[i].data(), gt + (i + calib_nq + tune_nq) * K,
+                        K * sizeof(faiss::idx_t));
+        }
+    }
+    if (streaming) {
+        double t_test = stream_split(calib_nq + tune_nq, nq, test_labels,
+                                     test_nonconf, test_hits);
+        test_preds = ConannPredictionsView();
+        time_report.computeScores = time_report.computeScoresCalib +
+                                    time_report.computeScoresTune + t_test;
+        std::cout << "Time spent computing scores: "
+                  << time_report.computeScores << std::endl;
+    } else {
+        test_nonconf = take_nonconf(calib_nq + tune_nq, nq);
+        test_preds = preds.slice(calib_nq + tune_nq, nq);
+        if (fused_gt) {
+            sweep_ground_truth(test_preds, test_labels);
+        }
+        test_hits = compute_gt_hits(test_labels, test_preds);
     }
-    test_nonconf = std::vector<std::vector<float>>(all_nonconf_scores.begin() +
-                                                       calib_nq + tune_nq,
-                                                   all_nonconf_scores.end());
-    test_preds = std::vector<std::vector<std::vector<faiss::idx_t>>>(
-        all_preds.begin() + calib_nq + tune_nq, all_preds.end());
 
-    time_report.memoryCopyPostCompute = elapsed() - t1;
+    time_report.memoryCopyPostCompute =
+        elapsed() - t1 - (streaming ? time_report.computeScores : 0);
     std::cout << "Time spent doing memcpy: " << elapsed() - t1 << std::endl;
 }
 
-std::tuple<std::vector<std::vector<float>>,
-           std::vector<std::vector<std::vector<faiss::idx_t>>>>
+std::tuple<std::vector<std::vector<float>>, ConannPredictions>
 IndexIVF::compute_scores(CalibrationResults cal_params, faiss::idx_t num_queries,
-                         const float *queries) {
+                         const float *queries) const {
     // result vector for nearest neighbor ids
     std::vector<faiss::idx_t> nns(K * num_queries);
     // result vector for nearest neigbor distances
     std::vector<float> dis(K * num_queries);
 
-    // result vector for nonconformity scores assigned to all clusters per query
+    // result vector for nonconformity scores after each probe step per query
     // (nq * nlist), initialized.
     std::vector<std::vector<float>> nonconf_list(num_queries, std::vector<float>(n_list, 0.0f));
 
     // result vector for predicted vector ids of all K neighbors for each query
-    // for increasing nprobe values. This stores all incremental search results
-    // as nprobe is increased from 1 to nlist. shape: nq * nlist * k
-    std::vector<std::vector<std::vector<faiss::idx_t>>> all_preds_list(
-        num_queries, std::vector<std::vector<faiss::idx_t>>(
-                         n_list, std::vector<faiss::idx_t>(K)));
-
+    // for increasing nprobe values, as a changelog of the top-k insertions and
+    // evictions per query. Compacted into a ConannPredictions afterwards.
+    std::vector<std::vector<ConannTopkEntry>> all_preds_list(num_queries);
+
+    // the calibration sweep probes all the lists, whatever this->nprobe is
+    IVFSearchParameters params;
+    params.nprobe = nlist;
+    params.max_codes = max_codes;
     search_with_error_quantification(
-        cal_params, num_queries, queries, K, dis.data(), nns.data(),
-        nonconf_list.data(), all_preds_list.data());
+        nullptr, num_queries, queries, K, dis.data(), nns.data(),
+        nonconf_list.data(), all_preds_list.data(), &params);
 
-    return std::make_tuple(nonconf_list, all_preds_list);
+    return std::make_tuple(std::move(nonconf_list),
+                           ConannPredictions(n_list, K, all_preds_list));
 }
 
 double IndexIVF::elapsed() {
@@ -1254,22 +1492,302 @@ IndexIVF::calibrate(float alpha, int k, float calib_sz, float tune_sz,
 
     double t0 = elapsed();
     prep_execution(alpha, calib_sz, tune_sz, xq, nq, gt);
+    CalibrationResults results = calibrate_prepared(alpha);
+    time_report.configureTotal = elapsed() - t0;
+    return results;
+}
+
+IndexIVF::CalibrationResults IndexIVF::calibrate_prepared(float alpha) {
+    return calibrate_prepared(std::vector<float>{alpha})[0];
+}
 
+std::vector<IndexIVF::CalibrationResults>
+IndexIVF::calibrate_prepared(const std::vector<float> &alphas) {
+    FAISS_THROW_IF_NOT(!alphas.empty());
     // NOTE: randomization disabled. Can enable easier by having a class-level
     // boolean. int kreg = pickKreg(tune_nonconf, alpha); // Regularization
     // hyperparameter
     double t1 = elapsed();
     int kreg = 1;
-    float lambda_reg = pick_lambda_reg(alpha, kreg);
+    std::vector<float> lambda_regs = pick_lambda_reg(alphas, kreg);
     time_report.pickRegLambda = elapsed() - t1;
     // std::cout << "Calib hyperparameters: kreg=" << kreg
     //           << " reg-lambda=" << lambda_reg << "\n";
 
-    auto lamhat = optimization(alpha, kreg, lambda_reg, calib_cx, calib_labels,
-                               calib_nonconf, calib_preds);
-    // std::cout << "Time spent optimizing: " << elapsed() - t1 << std::endl;
-    time_report.configureTotal = elapsed() - t0; 
-    return CalibrationResults{lamhat, kreg, lambda_reg};
+    // the FNR curve of the calib split does not depend on alpha: build it
+    // once per selected lambda_reg and read the lamhat of each alpha off it
+    std::vector<CalibrationResults> results(alphas.size());
+    std::vector<bool> done(alphas.size());
+    auto sorted_indices = compute_sorted_indices(calib_nonconf);
+    time_report.regularizeScores = 0;
+    time_report.optimize = 0;
+    for (size_t a = 0; a < alphas.size(); a++) {
+        if (done[a]) {
+            continue;
+        }
+        float lambda_reg = lambda_regs[a];
+        t1 = elapsed();
+        auto reg_nonconf_scores = regularize_scores(
+            calib_nonconf, sorted_indices, lambda_reg, kreg);
+        time_report.regularizeScores += elapsed() - t1;
+
+        t1 = elapsed();
+        FnrStepFunction fnr_curve =
+            compute_fnr_step_function(reg_nonconf_scores, calib_hits);
+        for (size_t b = a; b < alphas.size(); b++) {
+            if (done[b] || lambda_regs[b] != lambda_reg) {
+                continue;
+            }
+            float lamhat = find_lamhat(
+                fnr_curve,
+                conformal_target_fnr(alphas[b], calib_nonconf.size()));
+            results[b] = CalibrationResults{lamhat, kreg, lambda_reg};
+            set_probe_budgets(results[b]);
+            done[b] = true;
+        }
+        time_report.optimize += elapsed() - t1;
+    }
+
+    get_stop_thresholds(results.back());
+    calibration = results.back();
+    is_calibrated = true;
+    return results;
+}
+
+void IndexIVF::set_probe_budgets(CalibrationResults &results) const {
+    auto counts = compute_probe_counts(results, calib_nonconf);
+    auto tune_counts = compute_probe_counts(results, tune_nonconf);
+    counts.insert(counts.end(), tune_counts.begin(), tune_counts.end());
+    set_probe_budgets(results, std::move(counts));
+}
+
+void IndexIVF::set_probe_budgets(CalibrationResults &results,
+                                 std::vector<int> counts) const {
+    if (counts.empty() || results.lamhat > 1) {
+        results.nprobe_budget = nlist;
+        results.nprobe_prefetch = 0;
+        return;
+    }
+    std::sort(counts.begin(), counts.end());
+    results.nprobe_budget = std::max(1, counts.back());
+    size_t qi = std::min(counts.size() - 1,
+                         size_t(prefetch_quantile * counts.size()));
+    results.nprobe_prefetch = std::max(1, counts[qi]);
+}
+
+std::vector<IndexIVF::CalibrationResults> IndexIVF::calibrate_alpha_grid(
+    const std::vector<float> &alphas, int k, float calib_sz, float tune_sz,
+    float *xq, size_t nq, faiss::idx_t *gt, float max_distance,
+    std::string dataset) {
+    FAISS_THROW_IF_NOT(!alphas.empty());
+    K = k;
+    MAX_DISTANCE = max_distance;
+    dataset_name = dataset;
+
+    double t0 = elapsed();
+    prep_execution(alphas[0], calib_sz, tune_sz, xq, nq, gt);
+    auto results = calibrate_prepared(alphas);
+    time_report.configureTotal = elapsed() - t0;
+    return results;
+}
+
+std::vector<IndexIVF::CalibrationResults>
+IndexIVF::calibrate(float alpha, const std::vector<int> &ks, float calib_sz,
+                    float tune_sz, float *xq, size_t nq, faiss::idx_t *gt,
+                    float max_distance, std::string dataset) {
+    FAISS_THROW_IF_NOT(!ks.empty());
+    FAISS_THROW_IF_NOT(*std::min_element(ks.begin(), ks.end()) > 0);
+    FAISS_THROW_IF_NOT_MSG(calibration_block_size == 0,
+                           "multi-k calibration needs the predictions of the "
+                           "sweep, it does not support streaming");
+    int k_max = *std::max_element(ks.begin(), ks.end());
+    K = k_max;
+    MAX_DISTANCE = max_distance;
+    dataset_name = dataset;
+
+    double t0 = elapsed();
+    // one sweep with the largest k, the smaller ones are derived from it
+    prep_execution(alpha, calib_sz, tune_sz, xq, nq, gt);
+
+    std::vector<std::vector<float>> *split_nonconf[3] = {
+        &calib_nonconf, &tune_nonconf, &test_nonconf};
+    std::vector<std::vector<idx_t>> *split_labels[3] = {
+        &calib_labels, &tune_labels, &test_labels};
+    ConannPredictionsView *split_preds[3] = {&calib_preds, &tune_preds,
+                                             &test_preds};
+    GtHits *split_hits[3] = {&calib_hits, &tune_hits, &test_hits};
+
+    // state of the k_max sweep, restored for its own calibration
+    std::vector<std::vector<float>> full_nonconf[3];
+    std::vector<std::vector<idx_t>> full_labels[3];
+    ConannPredictionsView full_preds[3];
+    GtHits full_hits[3];
+    for (int s = 0; s < 3; s++) {
+        full_nonconf[s] = std::move(*split_nonconf[s]);
+        full_labels[s] = std::move(*split_labels[s]);
+        full_preds[s] = *split_preds[s];
+        full_hits[s] = std::move(*split_hits[s]);
+    }
+
+    std::vector<CalibrationResults> results(ks.size());
+    ConannPredictions preds_k[3]; // own the views of the restricted splits
+    for (size_t i = 0; i < ks.size(); i++) {
+        int k = ks[i];
+        if (k == k_max) {
+            continue;
+        }
+        K = k;
+        for (int s = 0; s < 3; s++) {
+            std::tie(*split_nonconf[s], preds_k[s]) =
+                restrict_scores(full_nonconf[s], full_preds[s], k);
+            *split_preds[s] = preds_k[s].view();
+            auto &labels = *split_labels[s];
+            labels.resize(full_labels[s].size());
+            if (gt) {
+                // the ground truth is sorted by distance
+                for (size_t q = 0; q < labels.size(); q++) {
+                    labels[q].assign(full_labels[s][q].begin(),
+                                     full_labels[s][q].begin() + k);
+                }
+            } else {
+                sweep_ground_truth(*split_preds[s], labels);
+            }
+            *split_hits[s] = compute_gt_hits(labels, *split_preds[s]);
+        }
+        results[i] = calibrate_prepared(alpha);
+    }
+
+    // calibrated last, so the index is left calibrated for k_max
+    K = k_max;
+    for (int s = 0; s < 3; s++) {
+        *split_nonconf[s] = std::move(full_nonconf[s]);
+        *split_labels[s] = std::move(full_labels[s]);
+        *split_preds[s] = full_preds[s];
+        *split_hits[s] = std::move(full_hits[s]);
+    }
+    CalibrationResults res_max = calibrate_prepared(alpha);
+    for (size_t i = 0; i < ks.size(); i++) {
+        if (ks[i] == k_max) {
+            results[i] = res_max;
+        }
+    }
+    time_report.configureTotal = elapsed() - t0;
+    return results;
+}
+
+std::tuple<std::vector<std::vector<float>>, ConannPredictions>
+IndexIVF::restrict_scores(const std::vector<std::vector<float>> &nonconf,
+                          const ConannPredictionsView &preds, size_t k) const {
+    size_t nq = preds.size();
+    FAISS_THROW_IF_NOT(nonconf.size() == nq);
+    FAISS_THROW_IF_NOT_FMT(k > 0 && k <= preds.k,
+                           "cannot restrict a top-%zd sweep to k=%zd",
+                           preds.k, k);
+    const bool is_ip = metric_type == METRIC_INNER_PRODUCT;
+    const size_t nl = preds.nlist;
+    std::vector<std::vector<float>> nonconf_k(nq);
+    std::vector<std::vector<ConannTopkEntry>> logs(nq);
+
+#pragma omp parallel
+    {
+        // (step, 2 * entry + 1) for insertions, (step, 2 * entry) evictions
+        std::vector<std::pair<int32_t, size_t>> events;
+        // entries in the top-k of the sweep, best first
+        std::vector<size_t> active;
+        // ids in the restricted top-k (sorted by id), with their log index
+        std::vector<std::pair<idx_t, size_t>> topk_cur, topk_next;
+
+#pragma omp for
+        for (size_t q = 0; q < nq; q++) {
+            const ConannTopkEntry *E = preds.begin(q);
+            size_t ne = preds.end(q) - E;
+            auto better = [&](size_t a, size_t b) {
+                if (E[a].dis != E[b].dis) {
+                    return is_ip ? E[a].dis > E[b].dis : E[a].dis < E[b].dis;
+                }
+                return E[a].id < E[b].id;
+            };
+
+            events.clear();
+            for (size_t e = 0; e < ne; e++) {
+                events.emplace_back(E[e].first_step, 2 * e + 1);
+                if (E[e].last_step < (int32_t)nl) {
+                    events.emplace_back(E[e].last_step, 2 * e);
+                }
+            }
+            std::sort(events.begin(), events.end());
+
+            auto &row = nonconf_k[q];
+            auto &log = logs[q];
+            row.resize(nl);
+            active.clear();
+            topk_cur.clear();
+            // an incomplete top-k has the neutral k-th distance
+            float score = 1.0;
+            size_t ev = 0;
+            for (size_t step = 0; step < nl; step++) {
+                bool changed = false;
+                for (; ev < events.size() && events[ev].first == (int32_t)step;
+                     ev++) {
+                    size_t e = events[ev].second / 2;
+                    if (events[ev].second & 1) {
+                        active.insert(std::lower_bound(active.begin(),
+                                                       active.end(), e, better),
+                                      e);
+                    } else {
+                        active.erase(
+                            std::find(active.begin(), active.end(), e));
+                    }
+                    changed = true;
+                }
+
+                if (changed) {
+                    size_t n_top = std::min(k, active.size());
+                    topk_next.clear();
+                    for (size_t j = 0; j < n_top; j++) {
+                        topk_next.emplace_back(E[active[j]].id, active[j]);
+                    }
+                    std::sort(topk_next.begin(), topk_next.end());
+                    size_t a = 0;
+                    for (auto &next : topk_next) {
+                        while (a < topk_cur.size() &&
+                               topk_cur[a].first < next.first) {
+                            log[topk_cur[a++].second].last_step = step;
+                        }
+                        if (a < topk_cur.size() &&
+                            topk_cur[a].first == next.first) {
+                            next.second = topk_cur[a++].second;
+                        } else {
+                            float dis = E[next.second].dis;
+                            next.second = log.size();
+                            log.push_back(
+                                {next.first, (int32_t)step, (int32_t)nl, dis});
+                        }
+                    }
+                    for (; a < topk_cur.size(); a++) {
+                        log[topk_cur[a].second].last_step = step;
+                    }
+                    std::swap(topk_cur, topk_next);
+
+                    if (n_top == k) {
+                        // same operations as the sweep
+                        float score_k = E[active[k - 1]].dis;
+                        score = score_k > MAX_DISTANCE ? 1.0
+                                                       : score_k / MAX_DISTANCE;
+                    }
+                }
+                // with inner products the sweep scores the best similarity,
+                // which does not depend on k
+                row[step] = is_ip ? nonconf[q][step] : score;
+            }
+        }
+    }
+    return std::make_tuple(std::move(nonconf_k),
+                           ConannPredictions(nl, k, logs));
+}
+
+float IndexIVF::conformal_target_fnr(float alpha, size_t n) {
+    return (static_cast<float>(n) + 1.0f) / n * alpha - 1.0f / (n + 1.0f);
 }
 
 float IndexIVF::optimization(
@@ -1277,18 +1795,46 @@ float IndexIVF::optimization(
     const std::vector<std::vector<float>> &queries,
     const std::vector<std::vector<faiss::idx_t>> &labels,
     const std::vector<std::vector<float>> &nonconf_scores,
-    const std::vector<std::vector<std::vector<faiss::idx_t>>> &all_preds) {
+    const ConannPredictionsView &all_preds,
+    const std::vector<std::vector<int>> *sorted_indices) {
+    FAISS_THROW_IF_NOT(queries.size() == nonconf_scores.size());
+    return optimization(alpha, kreg, lambda_reg, nonconf_scores,
+                        compute_gt_hits(labels, all_preds), sorted_indices);
+}
+
+float IndexIVF::optimization(
+    float alpha, int kreg, float lambda_reg,
+    const std::vector<std::vector<float>> &nonconf_scores,
+    const GtHits &gt_hits,
+    const std::vector<std::vector<int>> *sorted_indices) {
 
     double t1 = elapsed();
-    auto sorted_indices_cn = compute_sorted_indices(nonconf_scores);
+    std::vector<std::vector<int>> sorted_indices_cn;
+    if (!sorted_indices) {
+        sorted_indices_cn = compute_sorted_indices(nonconf_scores);
+        sorted_indices = &sorted_indices_cn;
+    }
     auto reg_nonconf_scores =
-        regularize_scores(nonconf_scores, sorted_indices_cn, lambda_reg, kreg);
+        regularize_scores(nonconf_scores, *sorted_indices, lambda_reg, kreg);
     time_report.regularizeScores = elapsed() - t1;
 
     t1 = elapsed();
-    int n = queries.size();
-    float target_fnr =
-        (static_cast<float>(n) + 1.0f) / n * alpha - 1.0f / (n + 1.0f);
+    // the FNR curve only depends on the scores and labels, so its breakpoints
+    // are computed once rather than at every root-finder iteration
+    FnrStepFunction fnr_curve =
+        compute_fnr_step_function(reg_nonconf_scores, gt_hits);
+
+    float lamhat = find_lamhat(
+        fnr_curve, conformal_target_fnr(alpha, nonconf_scores.size()));
+    time_report.optimize = elapsed() - t1;
+    return lamhat;
+}
+
+float IndexIVF::find_lamhat(const FnrStepFunction &fnr_curve,
+                            float target_fnr) const {
+    if (exact_lamhat) {
+        return fnr_curve.min_admissible_lambda(target_fnr);
+    }
 
     // Logger to get loss function information
     // std::cout << "Opening log file" << std::endl;
@@ -1298,22 +1844,16 @@ float IndexIVF::optimization(
     gsl_root_fsolver *solver = gsl_root_fsolver_alloc(gsl_root_fsolver_brent);
     gsl_function F;
     struct LamhatParams {
-        IndexIVF *index_ivf;
+        const FnrStepFunction *fnr_curve;
         float target_fnr;
-        const std::vector<std::vector<float>> *queries;
-        const std::vector<std::vector<faiss::idx_t>> *labels;
-        const std::vector<std::vector<float>> *nonconf_scores;
-        const std::vector<std::vector<std::vector<faiss::idx_t>>> *all_preds;
     };
 
     F.function = [](double lambda, void *params) -> double {
         auto *args = static_cast<LamhatParams *>(params);
-        return args->index_ivf->lamhat_threshold(
-            static_cast<float>(lambda), args->target_fnr, *(args->queries),
-            *(args->labels), *(args->nonconf_scores), *(args->all_preds));
+        return args->fnr_curve->fnr(static_cast<float>(lambda)) -
+               args->target_fnr;
     };
-    LamhatParams params = {this,    target_fnr,          &queries,
-                           &labels, &reg_nonconf_scores, &all_preds};
+    LamhatParams params = {&fnr_curve, target_fnr};
     F.params = &params;
 
     double lamhat = 2.0f;
@@ -1348,8 +1888,7 @@ float IndexIVF::optimization(
     // fclose(stdout);
     // freopen("/dev/tty", "w", stdout); // Restore stdout to terminal
     // std::cout << "Log file closed." << std::endl;
-    // gsl_root_fsolver_free(solver);
-    time_report.optimize = elapsed() - t1;
+    gsl_root_fsolver_free(solver);
 
     if (status != GSL_SUCCESS) {
         std::cerr << "Root-finding failed to converge.\n";
@@ -1363,7 +1902,7 @@ double IndexIVF::lamhat_threshold(
     const std::vector<std::vector<float>> &queries,
     const std::vector<std::vector<faiss::idx_t>> &labels,
     const std::vector<std::vector<float>> &nonconf_scores,
-    const std::vector<std::vector<std::vector<faiss::idx_t>>> &all_preds) {
+    const ConannPredictionsView &all_preds) {
     auto [preds, _] =
         compute_predictions(lambda, nonconf_scores, all_preds);
     float fnr = false_negative_rate(preds, labels);
@@ -1373,18 +1912,225 @@ double IndexIVF::lamhat_threshold(
     return fnr - target_fnr;
 }
 
+void IndexIVF::GtHits::append(const GtHits &other) {
+    if (size() == 0) {
+        k = other.k;
+    }
+    total_gt += other.total_gt;
+    idx_t base = offsets.back();
+    for (size_t q = 1; q < other.offsets.size(); q++) {
+        offsets.push_back(base + other.offsets[q]);
+    }
+    events.insert(events.end(), other.events.begin(), other.events.end());
+}
+
+void IndexIVF::sweep_ground_truth(const ConannPredictionsView &preds,
+                                  std::vector<std::vector<idx_t>> &labels,
+                                  size_t label0) const {
+    FAISS_THROW_IF_NOT(labels.size() >= label0 + preds.size());
+#pragma omp parallel for if (preds.size() > 1)
+    for (size_t q = 0; q < preds.size(); q++) {
+        auto &lab = labels[label0 + q];
+        lab.resize(preds.k);
+        lab.resize(preds.reconstruct(q, preds.nlist - 1, lab.data()));
+    }
+}
+
+IndexIVF::GtHits IndexIVF::compute_gt_hits(
+    const std::vector<std::vector<faiss::idx_t>> &labels,
+    const ConannPredictionsView &preds, size_t label0) const {
+    size_t nq = preds.size();
+    FAISS_THROW_IF_NOT(labels.size() >= label0 + nq);
+    std::vector<std::vector<std::pair<int32_t, int32_t>>> per_query(nq);
+
+    size_t total_gt = 0;
+#pragma omp parallel reduction(+ : total_gt)
+    {
+        std::unordered_set<faiss::idx_t> gt_set;
+
+#pragma omp for
+        for (size_t q = 0; q < nq; q++) {
+            const auto &lab = labels[label0 + q];
+            total_gt += lab.size();
+            gt_set.clear();
+            gt_set.insert(lab.begin(), lab.end());
+
+            // +1 when a ground-truth neighbor enters the top-k, -1 when it
+            // is evicted
+            auto &ev = per_query[q];
+            for (const ConannTopkEntry *e = preds.begin(q); e != preds.end(q);
+                 e++) {
+                if (gt_set.count(e->id)) {
+                    ev.emplace_back(e->first_step, 1);
+                    if (e->last_step < (int32_t)preds.nlist) {
+                        ev.emplace_back(e->last_step, -1);
+                    }
+                }
+            }
+            std::sort(ev.begin(), ev.end());
+            // merge the events of the same step
+            size_t wp = 0;
+            for (size_t r = 0; r < ev.size(); r++) {
+                if (wp > 0 && ev[wp - 1].first == ev[r].first) {
+                    ev[wp - 1].second += ev[r].second;
+                } else {
+                    ev[wp++] = ev[r];
+                }
+            }
+            ev.resize(wp);
+        }
+    }
+
+    GtHits h;
+    h.k = nq > 0 ? labels[label0].size() : 0;
+    h.total_gt = total_gt;
+    h.offsets.resize(nq + 1);
+    for (size_t q = 0; q < nq; q++) {
+        h.offsets[q + 1] = h.offsets[q] + per_query[q].size();
+    }
+    h.events.reserve(h.offsets[nq]);
+    for (const auto &ev : per_query) {
+        h.events.insert(h.events.end(), ev.begin(), ev.end());
+    }
+    return h;
+}
+
+IndexIVF::FnrStepFunction IndexIVF::compute_fnr_step_function(
+    const std::vector<std::vector<faiss::idx_t>> &labels,
+    const std::vector<std::vector<float>> &reg_nonconf,
+    const ConannPredictionsView &preds) const {
+    FAISS_THROW_IF_NOT(labels.size() == reg_nonconf.size() &&
+                       preds.size() == reg_nonconf.size());
+    return compute_fnr_step_function(reg_nonconf,
+                                     compute_gt_hits(labels, preds));
+}
+
+IndexIVF::FnrStepFunction IndexIVF::compute_fnr_step_function(
+    const std::vector<std::vector<float>> &reg_nonconf,
+    const GtHits &gt_hits) const {
+    FnrStepFunction sf;
+    sf.nq = reg_nonconf.size();
+    sf.nlist = sf.nq > 0 ? reg_nonconf[0].size() : 0;
+    sf.k = gt_hits.k;
+    sf.total_gt = gt_hits.total_gt;
+    FAISS_THROW_IF_NOT(gt_hits.size() == sf.nq);
+    for (const auto &sc : reg_nonconf) {
+        FAISS_THROW_IF_NOT(sc.size() == sf.nlist);
+    }
+    sf.scores.resize(sf.nq * sf.nlist);
+    sf.hits.resize(sf.nq * sf.nlist);
+
+#pragma omp parallel
+    {
+        std::vector<std::pair<float, size_t>> indexed_sc(sf.nlist);
+        std::vector<int32_t> hits_per_step(sf.nlist + 1);
+
+#pragma omp for
+        for (size_t q = 0; q < sf.nq; q++) {
+            const auto &sc = reg_nonconf[q];
+
+            // nb of ground-truth neighbors in the top-k after each step
+            std::fill(hits_per_step.begin(), hits_per_step.end(), 0);
+            for (idx_t e = gt_hits.offsets[q]; e < gt_hits.offsets[q + 1];
+                 e++) {
+                hits_per_step[gt_hits.events[e].first] +=
+                    gt_hits.events[e].second;
+            }
+            for (size_t j = 1; j < sf.nlist; j++) {
+                hits_per_step[j] += hits_per_step[j - 1];
+            }
+
+            // same ordering (and tie breaking) as compute_predictions
+            for (size_t j = 0; j < sf.nlist; j++) {
+                indexed_sc[j] = {sc[j], j};
+            }
+            std::sort(indexed_sc.begin(), indexed_sc.end(), std::less<>());
+            for (size_t j = 0; j < sf.nlist; j++) {
+                sf.scores[q * sf.nlist + j] = indexed_sc[j].first;
+                sf.hits[q * sf.nlist + j] = hits_per_step[indexed_sc[j].second];
+            }
+        }
+    }
+    return sf;
+}
+
+double IndexIVF::FnrStepFunction::fnr(float lambda) const {
+    size_t sum_hits = 0;
+    for (size_t q = 0; q < nq; q++) {
+        const float *sc = scores.data() + q * nlist;
+        // nb of probe steps whose score is <= lambda
+        size_t m = std::upper_bound(sc, sc + nlist, lambda) - sc;
+        if (m > 0) {
+            sum_hits += hits[q * nlist + m - 1];
+        }
+    }
+    if (total_gt > 0) {
+        return 1.0f - static_cast<float>(sum_hits) / total_gt;
+    } else {
+        return 0.0f;
+    }
+}
+
+float IndexIVF::FnrStepFunction::min_admissible_lambda(float target_fnr,
+                                                      float not_found) const {
+    // the fnr is 1 below the first breakpoint (0 without any ground truth)
+    if (total_gt == 0 || target_fnr >= 1.0f) {
+        return 0.0f;
+    }
+
+    // breakpoints where the nb of hits of a query changes, with the change
+    std::vector<std::pair<float, int32_t>> events;
+    for (size_t q = 0; q < nq; q++) {
+        int32_t prev_hits = 0;
+        for (size_t i = 0; i < nlist; i++) {
+            int32_t h = hits[q * nlist + i];
+            if (h != prev_hits) {
+                events.emplace_back(scores[q * nlist + i], h - prev_hits);
+                prev_hits = h;
+            }
+        }
+    }
+    std::sort(events.begin(), events.end());
+
+    int64_t sum_hits = 0;
+    for (size_t i = 0; i < events.size();) {
+        // apply all events at the same lambda before testing
+        float lambda = events[i].first;
+        for (; i < events.size() && events[i].first == lambda; i++) {
+            sum_hits += events[i].second;
+        }
+        float fnr = 1.0f - static_cast<float>(sum_hits) / total_gt;
+        if (fnr <= target_fnr) {
+            return lambda;
+        }
+    }
+    return not_found;
+}
+
+void IndexIVF::FnrStepFunction::evaluate(float lambda, std::vector<float> &fnrs,
+                                         std::vector<int> &cl_searched) const {
+    fnrs.resize(nq);
+    cl_searched.resize(nq);
+    for (size_t q = 0; q < nq; q++) {
+        const float *sc = scores.data() + q * nlist;
+        size_t m = std::upper_bound(sc, sc + nlist, lambda) - sc;
+        int32_t h = m > 0 ? hits[q * nlist + m - 1] : 0;
+        fnrs[q] = 1.0f - (static_cast<float>(h) / static_cast<float>(k));
+        cl_searched[q] = m > 0 ? m : -1;
+    }
+}
+
 std::pair<std::vector<std::vector<faiss::idx_t>>, std::vector<int>>
 IndexIVF::compute_predictions(
     float lambda,
     const std::vector<std::vector<float>> &nonconf_scores,
-    const std::vector<std::vector<std::vector<faiss::idx_t>>> &all_preds) {
+    const ConannPredictionsView &all_preds) {
 
     std::vector<std::vector<faiss::idx_t>> test_preds;
     std::vector<int> cl_searched;
 
     for (size_t query_idx = 0; query_idx < nonconf_scores.size(); ++query_idx) {
         const auto &sc = nonconf_scores[query_idx];
-        const auto &p = all_preds[query_idx];
 
         std::vector<std::pair<float, size_t>> indexed_sc;
         for (size_t i = 0; i < sc.size(); ++i) {
@@ -1396,12 +2142,10 @@ IndexIVF::compute_predictions(
                   std::less<>()); // Sort by value in ascending order
 
         // new implementation
-        float optimal_sc = -1;
         int index = indexed_sc.size();
         int num_cls_searched = 0;
         for (size_t i = 0; i < indexed_sc.size(); ++i) {
             if (indexed_sc[i].first <= lambda) {
-                optimal_sc = indexed_sc[i].first;
                 index = indexed_sc[i].second;
                 num_cls_searched = i+1;
             } else {
@@ -1410,7 +2154,9 @@ IndexIVF::compute_predictions(
         }
 
         if (index < sc.size() && num_cls_searched > 0) {
-            test_preds.push_back({p[index]});
+            std::vector<faiss::idx_t> p(all_preds.k);
+            p.resize(all_preds.reconstruct(query_idx, index, p.data()));
+            test_preds.push_back(std::move(p));
             cl_searched.push_back(num_cls_searched);
         } else {
             test_preds.push_back({});
@@ -1422,50 +2168,332 @@ IndexIVF::compute_predictions(
 
 void IndexIVF::search_conann(idx_t n, const float *x, float *distances,
                              idx_t *labels, CalibrationResults calib_params) {
-    
+    // lamhat > 1 disables early stopping
+    const float *thresholds = calib_params.lamhat <= 1
+                                  ? get_stop_thresholds(calib_params).data()
+                                  : nullptr;
+    SearchParametersConann params = conann_search_params(calib_params);
     search_with_error_quantification(
-        calib_params, n, x, K, distances, labels, nullptr, nullptr);
+        thresholds, n, x, K, distances, labels, nullptr, nullptr, &params);
 }
 
-std::vector<float> IndexIVF::recall_per_query(
-    const std::vector<std::vector<faiss::idx_t>> &prediction_set,
-    const std::vector<std::vector<faiss::idx_t>> &gt_labels) {
+void IndexIVF::search_conann(idx_t n, const float *x, float *distances,
+                             idx_t *labels) {
+    FAISS_THROW_IF_NOT_MSG(is_calibrated, "index is not calibrated");
+    search_conann(n, x, distances, labels, calibration);
+}
 
-    int nq = prediction_set.size();
-    int k = gt_labels[0].size();
-    int total_false_negatives = 0;
-    std::vector<float> fnrs_per_query(nq);
+void IndexIVF::search_conann_grouped(
+    idx_t n, const float *x, const int *entry, const std::vector<int> &entry_k,
+    const std::vector<CalibrationResults> &table,
+    const std::function<void(idx_t, const float *, const idx_t *)> &store)
+    const {
+    // stop thresholds of the entries in use
+    std::vector<std::vector<float>> thresholds(table.size());
+    std::vector<bool> used(table.size());
+    for (idx_t i = 0; i < n; i++) {
+        used[entry[i]] = true;
+    }
+    for (size_t e = 0; e < table.size(); e++) {
+        if (used[e] && table[e].lamhat <= 1) {
+            thresholds[e] = compile_stop_thresholds(table[e]);
+        }
+    }
 
-    for (size_t i = 0; i < nq; ++i) {
-        const std::set<int> pred_set(prediction_set[i].begin(),
-                                     prediction_set[i].end());
-        const std::set<int> gt_set(gt_labels[i].begin(), gt_labels[i].end());
-        // Calculate intersection size
-        int intersection_size = 0;
-        for (int pred : pred_set) {
-            if (gt_set.count(pred) > 0) {
-                ++intersection_size;
-            }
+    // queries grouped by entry and cut into chunks, so that threads take
+    // chunks of any entry and stay busy whatever the mix in the batch
+    std::vector<idx_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](idx_t a, idx_t b) {
+        return entry[a] < entry[b];
+    });
+    int nt = omp_get_max_threads();
+    idx_t chunk_size = std::max(idx_t(1), (n + 4 * nt - 1) / (4 * nt));
+    std::vector<std::pair<idx_t, idx_t>> chunks;
+    for (idx_t i0 = 0; i0 < n;) {
+        idx_t i1 = i0 + 1;
+        while (i1 < n && i1 - i0 < chunk_size &&
+               entry[order[i1]] == entry[order[i0]]) {
+            i1++;
         }
-        // FNR = 1 - (intersection_size / k)
-        fnrs_per_query[i] = 1.0f - (static_cast<float>(intersection_size) /
-                                    static_cast<float>(k));
-        total_false_negatives += k - intersection_size;
+        chunks.emplace_back(i0, i1);
+        i0 = i1;
     }
 
-    float overall_fnr = static_cast<float>(total_false_negatives) / (nq * k);
-    float check_fnr =
-        std::accumulate(fnrs_per_query.begin(), fnrs_per_query.end(), 0.0) /
-        fnrs_per_query.size();
-    std::cout << "Overall FNR: " << overall_fnr << "; Check FNR: " << check_fnr
-              << std::endl;
-    return fnrs_per_query;
+    std::vector<IndexIVFStats> stats(chunks.size());
+    std::mutex exception_mutex;
+    std::string exception_string;
+
+#pragma omp parallel for schedule(dynamic) if (chunks.size() > 1)
+    for (size_t c = 0; c < chunks.size(); c++) {
+        auto [i0, i1] = chunks[c];
+        idx_t nc = i1 - i0;
+        int e = entry[order[i0]];
+        idx_t k = entry_k[e];
+        SearchParametersConann params = conann_search_params(table[e]);
+
+        std::vector<float> xc(nc * d), dis(nc * k);
+        std::vector<idx_t> lab(nc * k);
+        for (idx_t j = 0; j < nc; j++) {
+            std::memcpy(xc.data() + j * d, x + order[i0 + j] * d,
+                        d * sizeof(float));
+        }
+        try {
+            search_slice_with_error_quantification(
+                thresholds[e].empty() ? nullptr : thresholds[e].data(), nc,
+                xc.data(), k, dis.data(), lab.data(), nullptr, nullptr,
+                &params, &stats[c]);
+        } catch (const std::exception &ex) {
+            std::lock_guard<std::mutex> lock(exception_mutex);
+            exception_string = ex.what();
+            continue;
+        }
+        for (idx_t j = 0; j < nc; j++) {
+            store(order[i0 + j], dis.data() + j * k, lab.data() + j * k);
+        }
+    }
+
+    if (!exception_string.empty()) {
+        FAISS_THROW_MSG(exception_string.c_str());
+    }
+    for (const auto &st : stats) {
+        indexIVF_stats.add(st);
+    }
 }
 
-double IndexIVF::false_negative_rate(
-    const std::vector<std::vector<faiss::idx_t>> &prediction_set,
-    const std::vector<std::vector<faiss::idx_t>> &gt_labels) {
-    std::vector<int> overlap;
+void IndexIVF::search_conann(idx_t n, const float *x, const idx_t *ks,
+                             const std::vector<int> &table_ks,
+                             const std::vector<CalibrationResults> &table,
+                             RangeSearchResult *result) const {
+    FAISS_THROW_IF_NOT(table_ks.size() == table.size());
+    FAISS_THROW_IF_NOT(result && result->nq == (size_t)n);
+
+    // calibration of each query
+    std::vector<int> entry(n);
+    for (idx_t i = 0; i < n; i++) {
+        auto it = std::find(table_ks.begin(), table_ks.end(), ks[i]);
+        FAISS_THROW_IF_NOT_FMT(it != table_ks.end(),
+                               "no calibration for k=%" PRId64 " (query %" PRId64
+                               ")",
+                               ks[i], i);
+        entry[i] = it - table_ks.begin();
+        result->lims[i] = ks[i];
+    }
+    result->do_allocation();
+
+    search_conann_grouped(
+        n, x, entry.data(), table_ks, table,
+        [&](idx_t i, const float *dis, const idx_t *lab) {
+            size_t ofs = result->lims[i];
+            std::memcpy(result->distances + ofs, dis, ks[i] * sizeof(float));
+            std::memcpy(result->labels + ofs, lab, ks[i] * sizeof(idx_t));
+        });
+}
+
+void IndexIVF::search_conann(idx_t n, const float *x, const float *alphas,
+                             const std::vector<float> &table_alphas,
+                             const std::vector<CalibrationResults> &table,
+                             float *distances, idx_t *labels) const {
+    FAISS_THROW_IF_NOT(table_alphas.size() == table.size());
+
+    // per query, the largest alpha of the table within its budget. The last
+    // entry, without early stopping, serves budgets below the whole table.
+    std::vector<CalibrationResults> entries = table;
+    entries.push_back(CalibrationResults{2, 0, 0});
+    std::vector<int> entry(n);
+    for (idx_t i = 0; i < n; i++) {
+        int best = table.size();
+        for (size_t e = 0; e < table.size(); e++) {
+            if (table_alphas[e] <= alphas[i] &&
+                (best == (int)table.size() ||
+                 table_alphas[e] > table_alphas[best])) {
+                best = e;
+            }
+        }
+        entry[i] = best;
+    }
+
+    std::vector<int> entry_k(entries.size(), K);
+    search_conann_grouped(
+        n, x, entry.data(), entry_k, entries,
+        [&](idx_t i, const float *dis, const idx_t *lab) {
+            std::memcpy(distances + i * K, dis, K * sizeof(float));
+            std::memcpy(labels + i * K, lab, K * sizeof(idx_t));
+        });
+}
+
+int IndexIVF::compute_probe_count(const CalibrationResults &calib_params,
+                                  const std::vector<float> &nonconf) const {
+    if (calib_params.lamhat > 1) {
+        return nlist;
+    }
+    const float max_reg_val =
+        (1 + calib_params.regLambda * (nlist - calib_params.kreg)) + 10;
+    // the regularized scores increase along the probe order, the search
+    // probes the lists before the first one above lamhat
+    int m = 0;
+    while (m < (int)nonconf.size()) {
+        float reg_score =
+            (1 - nonconf[m]) + compute_regularization(m + 1,
+                                                      calib_params.regLambda,
+                                                      calib_params.kreg);
+        if (reg_score / max_reg_val > calib_params.lamhat) {
+            break;
+        }
+        m++;
+    }
+    return m;
+}
+
+std::vector<int> IndexIVF::compute_probe_counts(
+    const CalibrationResults &calib_params,
+    const std::vector<std::vector<float>> &nonconf) const {
+    std::vector<int> counts(nonconf.size());
+    for (size_t q = 0; q < nonconf.size(); q++) {
+        counts[q] = compute_probe_count(calib_params, nonconf[q]);
+    }
+    return counts;
+}
+
+int IndexIVF::compute_nprobe_budget(
+    const CalibrationResults &calib_params,
+    const std::vector<std::vector<float>> &nonconf) const {
+    if (calib_params.lamhat > 1) {
+        return nlist;
+    }
+    auto counts = compute_probe_counts(calib_params, nonconf);
+    int budget = 1;
+    for (int m : counts) {
+        budget = std::max(budget, m);
+    }
+    return budget;
+}
+
+SearchParametersConann IndexIVF::conann_search_params(
+    const CalibrationResults &calib_params) const {
+    SearchParametersConann params;
+    params.nprobe = calib_params.nprobe_budget > 0
+                        ? std::min(nlist, size_t(calib_params.nprobe_budget))
+                        : nlist;
+    params.prefetch_nprobe =
+        std::min(params.nprobe, size_t(std::max(0, calib_params.nprobe_prefetch)));
+    params.max_codes = max_codes;
+    params.extend_budget = extend_nprobe_budget;
+    return params;
+}
+
+namespace {
+
+// order-preserving map between (non-NaN) floats and uint32
+uint32_t float_to_ordered(float f) {
+    uint32_t b;
+    std::memcpy(&b, &f, sizeof(b));
+    return (b & 0x80000000u) ? ~b : (b | 0x80000000u);
+}
+
+float ordered_to_float(uint32_t u) {
+    uint32_t b = (u & 0x80000000u) ? (u & 0x7fffffffu) : ~u;
+    float f;
+    std::memcpy(&f, &b, sizeof(f));
+    return f;
+}
+
+} // namespace
+
+std::vector<float> IndexIVF::compile_stop_thresholds(
+    const CalibrationResults &calib_params) const {
+    const float max_reg_val =
+        (1 + calib_params.regLambda * (nlist - calib_params.kreg)) + 10;
+    std::vector<float> thresholds(nlist);
+
+    for (size_t ik = 0; ik < nlist; ik++) {
+        float reg = compute_regularization(ik + 1, calib_params.regLambda,
+                                           calib_params.kreg);
+        // same float operations as the scores used during calibration
+        auto stops = [&](float score_k) {
+            float nonconf_score = std::min(score_k / MAX_DISTANCE, 1.0f);
+            float reg_score_k = ((1 - nonconf_score) + reg) / max_reg_val;
+            return reg_score_k > calib_params.lamhat;
+        };
+
+        // stops() is monotone in score_k: binary search for the largest
+        // distance that still stops, over the ordered float bit patterns
+        const float inf = std::numeric_limits<float>::infinity();
+        uint32_t lo = float_to_ordered(-inf), hi = float_to_ordered(inf);
+        if (stops(inf)) {
+            thresholds[ik] = inf;
+            continue;
+        }
+        if (!stops(-inf)) {
+            thresholds[ik] = -inf;
+            continue;
+        }
+        while (hi - lo > 1) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (stops(ordered_to_float(mid))) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        thresholds[ik] = ordered_to_float(lo);
+    }
+    return thresholds;
+}
+
+const std::vector<float> &
+IndexIVF::get_stop_thresholds(const CalibrationResults &calib_params) {
+    if (stop_thresholds.size() != nlist ||
+        stop_thresholds_max_distance != MAX_DISTANCE ||
+        stop_thresholds_params.lamhat != calib_params.lamhat ||
+        stop_thresholds_params.kreg != calib_params.kreg ||
+        stop_thresholds_params.regLambda != calib_params.regLambda) {
+        stop_thresholds = compile_stop_thresholds(calib_params);
+        stop_thresholds_params = calib_params;
+        stop_thresholds_max_distance = MAX_DISTANCE;
+    }
+    return stop_thresholds;
+}
+
+std::vector<float> IndexIVF::recall_per_query(
+    const std::vector<std::vector<faiss::idx_t>> &prediction_set,
+    const std::vector<std::vector<faiss::idx_t>> &gt_labels) {
+
+    int nq = prediction_set.size();
+    int k = gt_labels[0].size();
+    int total_false_negatives = 0;
+    std::vector<float> fnrs_per_query(nq);
+
+    for (size_t i = 0; i < nq; ++i) {
+        const std::set<int> pred_set(prediction_set[i].begin(),
+                                     prediction_set[i].end());
+        const std::set<int> gt_set(gt_labels[i].begin(), gt_labels[i].end());
+        // Calculate intersection size
+        int intersection_size = 0;
+        for (int pred : pred_set) {
+            if (gt_set.count(pred) > 0) {
+                ++intersection_size;
+            }
+        }
+        // FNR = 1 - (intersection_size / k)
+        fnrs_per_query[i] = 1.0f - (static_cast<float>(intersection_size) /
+                                    static_cast<float>(k));
+        total_false_negatives += k - intersection_size;
+    }
+
+    float overall_fnr = static_cast<float>(total_false_negatives) / (nq * k);
+    float check_fnr =
+        std::accumulate(fnrs_per_query.begin(), fnrs_per_query.end(), 0.0) /
+        fnrs_per_query.size();
+    std::cout << "Overall FNR: " << overall_fnr << "; Check FNR: " << check_fnr
+              << std::endl;
+    return fnrs_per_query;
+}
+
+double IndexIVF::false_negative_rate(
+    const std::vector<std::vector<faiss::idx_t>> &prediction_set,
+    const std::vector<std::vector<faiss::idx_t>> &gt_labels) {
+    std::vector<int> overlap;
     for (size_t i = 0; i < prediction_set.size(); ++i) {
         const std::set<int> pred_set(prediction_set[i].begin(),
                                      prediction_set[i].end());
@@ -1495,14 +2523,28 @@ double IndexIVF::false_negative_rate(
 
 std::pair<std::vector<float>, std::vector<int>>
 IndexIVF::evaluate_test(CalibrationResults params) {
-    return evaluate(params, test_cx, test_labels, test_nonconf, test_preds);
+    if (test_preds.size() == test_nonconf.size()) {
+        return evaluate(params, test_cx, test_labels, test_nonconf,
+                        test_preds);
+    }
+    // streaming mode: the predictions were dropped, evaluate from the
+    // ground-truth hits (same values as evaluate)
+    auto sorted_indices = compute_sorted_indices(test_nonconf);
+    auto reg_nonconf_scores = regularize_scores(
+        test_nonconf, sorted_indices, params.regLambda, params.kreg);
+    auto fnr_curve = compute_fnr_step_function(reg_nonconf_scores, test_hits);
+    std::vector<float> fnrs;
+    std::vector<int> cl_searched;
+    fnr_curve.evaluate(params.lamhat, fnrs, cl_searched);
+    return {fnrs, cl_searched};
 }
 
 std::pair<std::vector<float>, std::vector<int>> IndexIVF::evaluate(
     CalibrationResults params, const std::vector<std::vector<float>> &queries,
     const std::vector<std::vector<faiss::idx_t>> &labels,
     const std::vector<std::vector<float>> &nonconf_scores,
-    const std::vector<std::vector<std::vector<faiss::idx_t>>> &all_preds) {
+    const ConannPredictionsView &all_preds,
+    const std::vector<std::vector<int>> *sorted_indices) {
 
     float regLambda = params.regLambda; // Regularization hyperparameter
     int kreg = params.kreg;             // Regularization hyperparameter
@@ -1510,9 +2552,13 @@ std::pair<std::vector<float>, std::vector<int>> IndexIVF::evaluate(
               << " reg-lambda=" << regLambda << "\n";
 
     auto t1 = elapsed();
-    auto sortedIndices = compute_sorted_indices(nonconf_scores);
+    std::vector<std::vector<int>> sortedIndices;
+    if (!sorted_indices) {
+        sortedIndices = compute_sorted_indices(nonconf_scores);
+        sorted_indices = &sortedIndices;
+    }
     auto reg_nonconf_scores =
-        regularize_scores(nonconf_scores, sortedIndices, regLambda, kreg);
+        regularize_scores(nonconf_scores, *sorted_indices, regLambda, kreg);
     std::cout << "Time spent regularizing scores: " << elapsed() - t1
               << std::endl;
           
@@ -1555,20 +2601,18 @@ float IndexIVF::compute_regularization(int ox_y, float lambda, int kreg) const {
 
 std::vector<std::vector<int>> IndexIVF::compute_sorted_indices(
     const std::vector<std::vector<float>> &class_probabilities) const {
-    std::vector<std::vector<int>> sorted_indices;
-    for (const auto &probs : class_probabilities) {
-        std::vector<std::pair<int, float>> indexed_classes;
-        for (int i = 0; i < probs.size(); ++i) {
-            indexed_classes.emplace_back(i, probs[i]);
-        }
-        std::sort(
-            indexed_classes.begin(), indexed_classes.end(),
-            [](const auto &a, const auto &b) { return b.second < a.second; });
-        std::vector<int> sorted_class_indices;
-        for (const auto &pair : indexed_classes) {
-            sorted_class_indices.push_back(pair.first);
-        }
-        sorted_indices.push_back(sorted_class_indices);
+    size_t n = class_probabilities.size();
+    std::vector<std::vector<int>> sorted_indices(n);
+#pragma omp parallel for if (n > 1)
+    for (size_t i = 0; i < n; ++i) {
+        const auto &probs = class_probabilities[i];
+        auto &idx = sorted_indices[i];
+        idx.resize(probs.size());
+        std::iota(idx.begin(), idx.end(), 0);
+        // sort by probability in descending order
+        std::sort(idx.begin(), idx.end(), [&probs](int a, int b) {
+            return probs[b] < probs[a] || (probs[b] == probs[a] && a < b);
+        });
     }
     return sorted_indices;
 }
@@ -1576,12 +2620,7 @@ std::vector<std::vector<int>> IndexIVF::compute_sorted_indices(
 int IndexIVF::pick_kreg(const std::vector<std::vector<float>> &scores_per_q,
                         float alpha) const {
     size_t n = scores_per_q.size();
-    std::vector<int> rank_per_query;
-    for (const auto &row : scores_per_q) {
-        std::set<float> unique_scores(row.begin(), row.end());
-        int highest_rank = unique_scores.size();
-        rank_per_query.push_back(1);
-    }
+    std::vector<int> rank_per_query(n, 1);
     std::vector<int> sorted_ranks = rank_per_query;
     std::sort(sorted_ranks.begin(), sorted_ranks.end());
     int kstar_idx = std::ceil((1.0f - alpha) * (n + 1));
@@ -1590,29 +2629,68 @@ int IndexIVF::pick_kreg(const std::vector<std::vector<float>> &scores_per_q,
 }
 
 float IndexIVF::pick_lambda_reg(float alpha, int kreg) const {
-    int best_size = n_list;
-    float lambda_star = 0;
-    std::vector<float> lambda_values = {0.0, 0.001, 0.01, 0.1};
-    for (float temp_lambda : lambda_values) {
-        auto lamhat = const_cast<faiss::IndexIVF *>(this)->optimization(
-            alpha, kreg, temp_lambda, tune_cx, tune_labels, tune_nonconf,
-            tune_preds);
-        auto params = CalibrationResults{lamhat, kreg, temp_lambda};
-        auto [fnrs, cls] = const_cast<faiss::IndexIVF *>(this)->evaluate(
-            params, tune_cx, tune_labels, tune_nonconf, tune_preds);
-        float average_fnr = std::accumulate(fnrs.begin(), fnrs.end(), 0.0f) / fnrs.size();
-        float avg_cls_searched =
-            std::accumulate(cls.begin(), cls.end(), 0.0) / cls.size();
-        std::cout << "Avg cls searched=" << avg_cls_searched << "\n";
-        if (avg_cls_searched < best_size && average_fnr <= alpha) {
-            lambda_star = temp_lambda;
-            best_size = avg_cls_searched;
-            std::cout << "Found better lambda_reg=" << lambda_star
-                      << ". Updating.\n";
-        }
-    }
-    std::cout << "Best lambda_reg found=" << lambda_star << "\n";
-    return lambda_star;
+    return pick_lambda_reg(std::vector<float>{alpha}, kreg)[0];
+}
+
+std::vector<float> IndexIVF::pick_lambda_reg(const std::vector<float> &alphas,
+                                             int kreg) const {
+    const std::vector<float> &lambda_values = lambda_reg_grid;
+    size_t nv = lambda_values.size();
+    size_t na = alphas.size();
+    // the rank permutation does not depend on lambda_reg
+    auto sorted_indices = compute_sorted_indices(tune_nonconf);
+
+    // the candidates only read the shared tune split, so they are calibrated
+    // and evaluated concurrently. The FNR curve of a candidate does not
+    // depend on alpha, all the alphas are evaluated on it. The selection
+    // below stays sequential.
+    std::vector<float> avg_fnrs(nv * na), avg_cls(nv * na);
+#pragma omp parallel for if (nv > 1)
+    for (size_t i = 0; i < nv; i++) {
+        auto reg_nonconf_scores = regularize_scores(
+            tune_nonconf, sorted_indices, lambda_values[i], kreg);
+        auto fnr_curve =
+            compute_fnr_step_function(reg_nonconf_scores, tune_hits);
+
+        std::vector<float> fnrs;
+        std::vector<int> cls;
+        for (size_t a = 0; a < na; a++) {
+            float lamhat = find_lamhat(
+                fnr_curve, conformal_target_fnr(alphas[a], tune_cx.size()));
+            fnr_curve.evaluate(lamhat, fnrs, cls);
+            avg_fnrs[i * na + a] =
+                std::accumulate(fnrs.begin(), fnrs.end(), 0.0f) / fnrs.size();
+            avg_cls[i * na + a] =
+                std::accumulate(cls.begin(), cls.end(), 0.0) / cls.size();
+        }
+    }
+
+    std::vector<float> lambda_stars(na);
+    for (size_t a = 0; a < na; a++) {
+        float alpha = alphas[a];
+        if (na > 1) {
+            std::cout << "alpha=" << alpha << "\n";
+        }
+        int best_size = n_list;
+        float lambda_star = 0;
+        for (size_t i = 0; i < nv; i++) {
+            float temp_lambda = lambda_values[i];
+            float average_fnr = avg_fnrs[i * na + a];
+            float avg_cls_searched = avg_cls[i * na + a];
+            std::cout << "lambda_reg=" << temp_lambda
+                      << " avg fnr=" << average_fnr
+                      << " avg cls searched=" << avg_cls_searched << "\n";
+            if (avg_cls_searched < best_size && average_fnr <= alpha) {
+                lambda_star = temp_lambda;
+                best_size = avg_cls_searched;
+                std::cout << "Found better lambda_reg=" << lambda_star
+                          << ". Updating.\n";
+            }
+        }
+        std::cout << "Best lambda_reg found=" << lambda_star << "\n";
+        lambda_stars[a] = lambda_star;
+    }
+    return lambda_stars;
 }
 
 std::vector<std::vector<float>>
@@ -1620,24 +2698,18 @@ IndexIVF::regularize_scores(const std::vector<std::vector<float>> &s,
                             const std::vector<std::vector<int>> &I,
                             float lambda_reg, int kreg) const {
     size_t n = s.size();
-    size_t K = s[0].size();
-    std::vector<std::vector<float>> E(n, std::vector<float>(K, 0.0f));
+    FAISS_THROW_IF_NOT(I.size() == n);
+    std::vector<std::vector<float>> E(n);
     float max_reg_val = (1 + lambda_reg * (n_list - kreg)) + 10;
+#pragma omp parallel for if (n > 1)
     for (size_t i = 0; i < n; ++i) {
-        std::vector<std::pair<int, float>> sorted_classes;
-        for (int j = 0; j < K; ++j) {
-            sorted_classes.push_back({j, s[i][j]});
-        }
-        std::sort(
-            sorted_classes.rbegin(), sorted_classes.rend(),
-            [](const std::pair<int, float> &a, const std::pair<int, float> &b) {
-                return a.second < b.second;
-            });
-        auto ox = compute_ox(sorted_classes);
+        size_t K = s[i].size();
+        E[i].resize(K);
+        // I[i][j] is the class of rank j + 1
         for (size_t j = 0; j < K; ++j) {
-            int original_class_index = sorted_classes[j].first;
+            int original_class_index = I[i][j];
             float Eij = 1.0f - s[i][original_class_index];
-            Eij += compute_regularization(ox[j], lambda_reg, kreg);
+            Eij += compute_regularization(j + 1, lambda_reg, kreg);
             E[i][original_class_index] = Eij / max_reg_val;
         }
     }
@@ -1646,12 +2718,164 @@ IndexIVF::regularize_scores(const std::vector<std::vector<float>> &s,
 
 // ------------
 
+namespace {
+
+/* distances of the n queries x to all the centroids of a flat quantizer
+ * (n * nlist), with the kernels and float operations that IndexFlat::search
+ * uses for a batch of batch_size queries, so that ranking them gives the
+ * same coarse assignment as quantizer->search on that batch. y_norms: the
+ * squared norms of the centroids (L2 with BLAS only). */
+void flat_quantizer_distances(const IndexFlat &flat, size_t n, const float *x,
+                              size_t batch_size, const float *y_norms,
+                              float *dis) {
+    const size_t d = flat.d;
+    const size_t nc = flat.ntotal;
+    const float *y = flat.get_xb();
+    const bool is_ip = flat.metric_type == METRIC_INNER_PRODUCT;
+
+    if (batch_size < (size_t)distance_compute_blas_threshold) {
+        for (size_t i = 0; i < n; i++) {
+            const float *xi = x + i * d;
+            float *di = dis + i * nc;
+            for (size_t j = 0; j < nc; j++) {
+                di[j] = is_ip ? fvec_inner_product(xi, y + j * d, d)
+                              : fvec_L2sqr(xi, y + j * d, d);
+            }
+        }
+        return;
+    }
+    if (n == 0) {
+        return;
+    }
+
+    const size_t bs_y = distance_compute_blas_database_bs;
+    for (size_t j0 = 0; j0 < nc; j0 += bs_y) {
+        size_t j1 = std::min(nc, j0 + bs_y);
+        float one = 1, zero = 0;
+        FINTEGER nyi = j1 - j0, nxi = n, di = d, lddi = nc;
+        sgemm_("Transpose", "Not transpose", &nyi, &nxi, &di, &one,
+               y + j0 * d, &di, x, &di, &zero, dis + j0, &lddi);
+    }
+    if (is_ip) {
+        return;
+    }
+    std::vector<float> x_norms(n);
+    fvec_norms_L2sqr(x_norms.data(), x, d, n);
+    for (size_t i = 0; i < n; i++) {
+        float *di = dis + i * nc;
+        for (size_t j = 0; j < nc; j++) {
+            float dij = x_norms[i] + y_norms[j] - 2 * di[j];
+            // negative values can occur for identical vectors due to
+            // roundoff errors
+            di[j] = dij < 0 ? 0 : dij;
+        }
+    }
+}
+
+/* coarse assignment of the n queries x past their first nprobe centroids
+ * (keys, n * nprobe): the other centroids by increasing distance, nlist -
+ * nprobe per query, padded with -1. */
+void extend_coarse_assignment(const Index &quantizer, size_t nlist, idx_t n,
+                              const float *x, size_t nprobe, const idx_t *keys,
+                              idx_t *ext_keys, float *ext_dis,
+                              const SearchParameters *quantizer_params) {
+    std::unique_ptr<idx_t[]> all_keys(new idx_t[n * nlist]);
+    std::unique_ptr<float[]> all_dis(new float[n * nlist]);
+    quantizer.search(n, x, nlist, all_dis.get(), all_keys.get(),
+                     quantizer_params);
+    const size_t next = nlist - nprobe;
+    std::vector<bool> seen(nlist);
+    for (idx_t i = 0; i < n; i++) {
+        const idx_t *ki = keys + i * nprobe;
+        for (size_t j = 0; j < nprobe; j++) {
+            if (ki[j] >= 0) {
+                seen[ki[j]] = true;
+            }
+        }
+        size_t m = 0;
+        for (size_t j = 0; j < nlist && m < next; j++) {
+            idx_t key = all_keys[i * nlist + j];
+            if (key >= 0 && !seen[key]) {
+                ext_keys[i * next + m] = key;
+                ext_dis[i * next + m] = all_dis[i * nlist + j];
+                m++;
+            }
+        }
+        for (; m < next; m++) {
+            ext_keys[i * next + m] = -1;
+            ext_dis[i * next + m] = 0;
+        }
+        for (size_t j = 0; j < nprobe; j++) {
+            if (ki[j] >= 0) {
+                seen[ki[j]] = false;
+            }
+        }
+    }
+}
+
+/* the w centroids that follow (last_dis, last_id) in the order of C among
+ * the nlist distances of a query, nearest first. C::cmp2 breaks the ties on
+ * the ids so that consecutive windows neither skip nor repeat a centroid.
+ * A threshold estimated on a strided sample of the distances keeps about 2w
+ * candidates, which avoids maintaining a heap over the whole row. */
+template <class C>
+void rank_coarse_window(size_t nlist, const float *dis, size_t w, bool first,
+                        float last_dis, idx_t last_id,
+                        std::vector<std::pair<float, idx_t>> &win,
+                        std::vector<float> &sample) {
+    using Entry = std::pair<float, idx_t>;
+    auto better = [](const Entry &a, const Entry &b) {
+        return C::cmp2(b.first, a.first, b.second, a.second);
+    };
+    auto after_last = [&](size_t j) {
+        return first || C::cmp2(dis[j], last_dis, j, last_id);
+    };
+
+    const size_t stride = 16;
+    float thr = C::neutral();
+    if (w < nlist / 8 && nlist >= 8 * stride) {
+        size_t r = 2 * w / stride + 2;
+        sample.clear();
+        for (size_t j = 0; j < nlist; j += stride) {
+            if (after_last(j)) {
+                sample.push_back(dis[j]);
+            }
+        }
+        if (sample.size() > r) {
+            std::nth_element(sample.begin(), sample.begin() + r, sample.end(),
+                             [](float a, float b) { return C::cmp(b, a); });
+            thr = sample[r];
+        }
+    }
+    // retried without threshold if the sample over-estimated it
+    for (int attempt = 0; attempt < 2; attempt++) {
+        win.clear();
+        for (size_t j = 0; j < nlist; j++) {
+            if (!C::cmp(dis[j], thr) && after_last(j)) {
+                win.emplace_back(dis[j], j);
+            }
+        }
+        if (win.size() >= w) {
+            break;
+        }
+        thr = C::neutral();
+    }
+    if (win.size() > w) {
+        std::nth_element(win.begin(), win.begin() + (w - 1), win.end(),
+                         better);
+        win.resize(w);
+    }
+    std::sort(win.begin(), win.end(), better);
+}
+
+} // namespace
+
 // parallelized search, executes search_preassigned_with_error_quantification
 // internally
 void IndexIVF::search_with_error_quantification(
-    CalibrationResults cal_params, idx_t n, const float *x, idx_t k, float *distances,
+    const float *stop_thresholds, idx_t n, const float *x, idx_t k, float *distances,
     idx_t *labels, std::vector<float> *nonconf_list,
-    std::vector<std::vector<faiss::idx_t>> *all_preds_list,
+    std::vector<ConannTopkEntry> *all_preds_list,
     const SearchParameters *params_in) const {
 
     FAISS_THROW_IF_NOT(k > 0);
@@ -1661,42 +2885,28 @@ void IndexIVF::search_with_error_quantification(
         params = dynamic_cast<const IVFSearchParameters *>(params_in);
         FAISS_THROW_IF_NOT_MSG(params, "IndexIVF params have incorrect type");
     }
-    const size_t nprobe =
-        std::min(nlist, params ? params->nprobe : this->nprobe);
-    FAISS_THROW_IF_NOT(nprobe > 0);
+    FAISS_THROW_IF_NOT(std::min(nlist, params ? params->nprobe
+                                               : this->nprobe) > 0);
 
     // search function for a subset of queries
     auto sub_search_func =
-        [this, k, nprobe,
-         params](CalibrationResults cal_params, idx_t n, const float *x, float *distances,
-                 idx_t *labels, IndexIVFStats *ivf_stats,
-                 std::vector<float> *nonconf_list,
-                 std::vector<std::vector<faiss::idx_t>> *all_preds_list) {
-            // flattened list of the cluster ids of each cluster to
-            // incrementally search for current list of queries
-            std::unique_ptr<idx_t[]> idx(new idx_t[n * nprobe]);
-            // flattened list of the distances to each cluster to incrementally
-            // search for current list of queries
-            std::unique_ptr<float[]> coarse_dis(new float[n * nprobe]);
-
-            double t0 = getmillisecs();
-
-            quantizer->search(n, x, nprobe, coarse_dis.get(), idx.get(),
-                              params ? params->quantizer_params : nullptr);
-
-            double t1 = getmillisecs();
-            invlists->prefetch_lists(idx.get(), n * nprobe);
-
-            search_preassigned_with_error_quantification(
-                cal_params, n, x, k, idx.get(), coarse_dis.get(), distances, labels,
-                false, nonconf_list, all_preds_list, params, ivf_stats);
-
-            double t2 = getmillisecs();
-            ivf_stats->quantization_time += t1 - t0;
-            ivf_stats->search_time += t2 - t0;
+        [this, k, params](const float *stop_thresholds, idx_t n, const float *x,
+                          float *distances, idx_t *labels,
+                          IndexIVFStats *ivf_stats,
+                          std::vector<float> *nonconf_list,
+                          std::vector<ConannTopkEntry> *all_preds_list) {
+            search_slice_with_error_quantification(
+                stop_thresholds, n, x, k, distances, labels, nonconf_list,
+                all_preds_list, params, ivf_stats);
         };
 
-    if ((parallel_mode & ~PARALLEL_MODE_NO_HEAP_INIT) == 0) {
+    if (cluster_major_search && all_preds_list == nullptr) {
+        // the parallelism is over the lists scanned in each probe round
+        IndexIVFStats local_stats;
+        search_cluster_major_with_error_quantification(
+            stop_thresholds, n, x, k, distances, labels, params, &local_stats);
+        indexIVF_stats.add(local_stats);
+    } else if ((parallel_mode & ~PARALLEL_MODE_NO_HEAP_INIT) == 0) {
         int nt = std::min(omp_get_max_threads(), int(n));
         std::vector<IndexIVFStats> stats(nt);
         std::mutex exception_mutex;
@@ -1711,13 +2921,13 @@ void IndexIVF::search_with_error_quantification(
                 try {
                     if (all_preds_list == nullptr) {
                     // Note: this bit of ugliness is needed because pointer arithmetic on a nullptr is undefined behaviour
-                    sub_search_func(cal_params, i1 - i0, x + i0 * d,
+                    sub_search_func(stop_thresholds, i1 - i0, x + i0 * d,
                                     distances + i0 * k, labels + i0 * k,
                                     &stats[slice], nullptr, nullptr);
                     } else {
                     // Note: pointer arithmetic is used to share datastructures
                     // between threads
-                    sub_search_func(cal_params, i1 - i0, x + i0 * d,
+                    sub_search_func(stop_thresholds, i1 - i0, x + i0 * d,
                                     distances + i0 * k, labels + i0 * k,
                                     &stats[slice], nonconf_list + i0,
                                     all_preds_list + i0);
@@ -1737,17 +2947,113 @@ void IndexIVF::search_with_error_quantification(
             indexIVF_stats.add(stats[slice]);
         }
     } else {
-        std::cout << "WARNING:: hopefully this case is never reached...\n";
-        // sub_search_func(n, x, distances, labels, &indexIVF_stats);
+        // parallel_mode 1 / 2: the parallelism is within the queries
+        IndexIVFStats local_stats;
+        sub_search_func(stop_thresholds, n, x, distances, labels,
+                        &local_stats, nonconf_list, all_preds_list);
+        indexIVF_stats.add(local_stats);
+    }
+}
+
+void IndexIVF::search_slice_with_error_quantification(
+    const float *stop_thresholds, idx_t n, const float *x, idx_t k,
+    float *distances, idx_t *labels, std::vector<float> *nonconf_list,
+    std::vector<ConannTopkEntry> *all_preds_list,
+    const IVFSearchParameters *params, IndexIVFStats *ivf_stats) const {
+    const size_t nprobe =
+        std::min(nlist, params ? params->nprobe : this->nprobe);
+
+    // early-terminating queries rarely use all of their nprobe centroids.
+    // The intra-query parallel modes need the ranked lists upfront.
+    int pmode = parallel_mode & ~PARALLEL_MODE_NO_HEAP_INIT;
+    auto flat_quantizer = dynamic_cast<const IndexFlat *>(quantizer);
+    const bool lazy_coarse =
+        lazy_coarse_assignment && stop_thresholds && !all_preds_list &&
+        pmode != 1 && pmode != 2 && flat_quantizer &&
+        (flat_quantizer->metric_type == METRIC_L2 ||
+         flat_quantizer->metric_type == METRIC_INNER_PRODUCT) &&
+        !(params && params->quantizer_params);
+    if (lazy_coarse) {
+        FAISS_THROW_IF_NOT(flat_quantizer->ntotal == (idx_t)nlist);
+        // the distances to all the centroids are computed with BLAS for
+        // blocks of queries, only their ranking is deferred to the probe
+        // loop. The blocks are bounded to 1 MiB of distances, so that the
+        // rows are still in cache when they are ranked.
+        const idx_t bs = std::max(
+            size_t(1), std::min(size_t(distance_compute_blas_query_bs),
+                                (size_t(1) << 18) / nlist));
+        std::unique_ptr<float[]> coarse_dis(
+            new float[std::min(n, bs) * nlist]);
+        std::vector<float> centroid_norms;
+        if (flat_quantizer->metric_type == METRIC_L2 &&
+            n >= distance_compute_blas_threshold) {
+            centroid_norms.resize(nlist);
+            fvec_norms_L2sqr(centroid_norms.data(), flat_quantizer->get_xb(),
+                             d, nlist);
+        }
+
+        double t0 = getmillisecs();
+        double t_quantize = 0;
+        for (idx_t i0 = 0; i0 < n; i0 += bs) {
+            idx_t i1 = std::min(n, i0 + bs);
+            double t1 = getmillisecs();
+            flat_quantizer_distances(*flat_quantizer, i1 - i0, x + i0 * d, n,
+                                     centroid_norms.data(), coarse_dis.get());
+            t_quantize += getmillisecs() - t1;
+            search_preassigned_with_error_quantification(
+                stop_thresholds, i1 - i0, x + i0 * d, k, nullptr,
+                coarse_dis.get(), distances + i0 * k, labels + i0 * k, false,
+                nullptr, nullptr, params, ivf_stats);
+        }
+        ivf_stats->quantization_time += t_quantize;
+        ivf_stats->search_time += getmillisecs() - t0;
+        return;
+    }
+    // flattened list of the cluster ids of each cluster to
+    // incrementally search for current list of queries
+    std::unique_ptr<idx_t[]> idx(new idx_t[n * nprobe]);
+    // flattened list of the distances to each cluster to incrementally
+    // search for current list of queries
+    std::unique_ptr<float[]> coarse_dis(new float[n * nprobe]);
+
+    double t0 = getmillisecs();
+
+    quantizer->search(n, x, nprobe, coarse_dis.get(), idx.get(),
+                      params ? params->quantizer_params : nullptr);
+
+    double t1 = getmillisecs();
+    // early stopping: only the first lists of each query are prefetched, the
+    // probe loop extends the window of the queries that keep probing
+    auto cparams = dynamic_cast<const SearchParametersConann *>(params);
+    size_t window = cparams && stop_thresholds && !all_preds_list
+                        ? cparams->prefetch_nprobe
+                        : 0;
+    if (window > 0 && window < nprobe) {
+        std::vector<idx_t> first_lists(n * window);
+        for (idx_t i = 0; i < n; i++) {
+            std::memcpy(first_lists.data() + i * window,
+                        idx.get() + i * nprobe, window * sizeof(idx_t));
+        }
+        invlists->prefetch_lists(first_lists.data(), n * window);
+    } else {
+        invlists->prefetch_lists(idx.get(), n * nprobe);
     }
+
+    search_preassigned_with_error_quantification(
+        stop_thresholds, n, x, k, idx.get(), coarse_dis.get(), distances,
+        labels, false, nonconf_list, all_preds_list, params, ivf_stats);
+
+    double t2 = getmillisecs();
+    ivf_stats->quantization_time += t1 - t0;
+    ivf_stats->search_time += t2 - t0;
 }
 
 // faiss search execution and conann non-conformity score calculations
 void IndexIVF::search_preassigned_with_error_quantification(
-    CalibrationResults cal_params, idx_t n, const float *x, idx_t k, const idx_t *keys,
+    const float *stop_thresholds, idx_t n, const float *x, idx_t k, const idx_t *keys,
     const float *coarse_dis, float *distances, idx_t *labels, bool store_pairs,
     std::vector<float> *nonconf_list,
-    std::vector<std::vector<faiss::idx_t>> *all_preds_list,
+    std::vector<ConannTopkEntry> *all_preds_list,
     const IVFSearchParameters *params, IndexIVFStats *ivf_stats) const {
     FAISS_THROW_IF_NOT(k > 0);
 
@@ -1755,6 +3061,13 @@ void IndexIVF::search_preassigned_with_error_quantification(
     nprobe = std::min((idx_t)nlist, nprobe);
     FAISS_THROW_IF_NOT(nprobe > 0);
 
+    // lazy coarse assignment: the rows of coarse_dis are the distances to
+    // all the centroids, ranked as the probe loop asks for the next one
+    const bool lazy_coarse = keys == nullptr;
+    FAISS_THROW_IF_NOT_MSG(!lazy_coarse || coarse_dis,
+                           "lazy coarse assignment needs the distances to "
+                           "all the centroids");
+
     const idx_t unlimited_list_size = std::numeric_limits<idx_t>::max();
     idx_t max_codes = params ? params->max_codes : this->max_codes;
     IDSelector *sel = params ? params->sel : nullptr;
@@ -1803,17 +3116,152 @@ void IndexIVF::search_preassigned_with_error_quantification(
     void *inverted_list_context =
         params ? params->inverted_list_context : nullptr;
 
+    // early stopping mode, used by search_conann only
+    const bool early_stop = all_preds_list == nullptr && stop_thresholds;
+    // prefetch window of the early stopping mode, see SearchParametersConann
+    auto cparams = dynamic_cast<const SearchParametersConann *>(params);
+    const idx_t prefetch_window =
+        early_stop && cparams && cparams->prefetch_nprobe > 0
+            ? std::min(nprobe, (idx_t)cparams->prefetch_nprobe)
+            : nprobe;
+    // the queries that exhaust the budget without the stop rule firing go on
+    // up to nlist, see SearchParametersConann::extend_budget
+    const idx_t nprobe_max = early_stop && cparams && cparams->extend_budget
+                                 ? (idx_t)nlist
+                                 : nprobe;
+    const SearchParameters *quantizer_params =
+        params ? params->quantizer_params : nullptr;
+    // with L2 the k-th distance is the root of the max-heap, and it can only
+    // decrease as more lists are probed
+    const bool kth_is_root = metric_type != METRIC_INNER_PRODUCT;
+
+    // reranking: the lists are scanned into a shortlist of the
+    // refine_k_factor * k best code distances, and the candidates that enter
+    // it are re-ranked into the result heap with refine_index
+    const bool refine = refine_index != nullptr;
+    const idx_t k_shortlist =
+        refine ? std::max(k, idx_t(k * refine_k_factor)) : k;
+    FAISS_THROW_IF_NOT_MSG(!refine || pmode == 0 || pmode == 3,
+                           "refine_index supported only for parallel_mode = "
+                           "0 or 3");
+    FAISS_THROW_IF_NOT_MSG(!refine || !store_pairs,
+                           "refine_index and store_pairs cannot be combined");
+    // the labels are the ids of refine_index (checked in full when
+    // calibrating, see check_refine_ids), here only their range
+    FAISS_THROW_IF_NOT_FMT(!refine || refine_index->ntotal == ntotal,
+                           "refine_index has %" PRId64
+                           " vectors, the index %" PRId64,
+                           refine ? refine_index->ntotal : 0, ntotal);
+
+    // intra-query modes: the threads scan the lists of a round into their
+    // own slot of these buffers, see below
+    const bool intra_query = pmode == 1 || pmode == 2;
+    FAISS_THROW_IF_NOT_MSG(!intra_query || !lazy_coarse,
+                           "parallel_mode 1/2 need the coarse assignment");
+    std::vector<float> round_dis;
+    std::vector<idx_t> round_ids;
+    int round_width = 1;
+    bool round_stop = false;
+    // probes of the current query and its centroids past the budget
+    idx_t round_nprobe = nprobe, round_next = 0;
+    std::vector<idx_t> round_ext_keys;
+    std::vector<float> round_ext_dis;
+
 #pragma omp parallel if (do_parallel) reduction(+ : nlistv, ndis, nheap)
     {
         std::unique_ptr<InvertedListScanner> scanner(
             get_InvertedListScanner(store_pairs, sel));
 
+        std::unique_ptr<DistanceComputer> refine_dc(
+            refine ? refine_index->get_distance_computer() : nullptr);
+        // shortlist heap of the query, and the ids it already re-ranked
+        std::vector<float> shortlist_dis(refine ? k_shortlist : 0);
+        std::vector<idx_t> shortlist_ids(refine ? k_shortlist : 0);
+        std::unordered_set<idx_t> reranked;
+
         /*****************************************************
          * Depending on parallel_mode, there are two possible ways
          * to organize the search. Here we define local functions
          * that are in common between the two
          ******************************************************/
 
+        // score of the k-th result in O(1) for L2. FAISS does not keep the
+        // inner product results ordered, so the largest one is searched.
+        auto kth_score = [&](const float *simi) {
+            return kth_is_root ? simi[0] : *std::max_element(simi, simi + k);
+        };
+
+        // lazy coarse assignment: the centroids of the query are ranked one
+        // window at a time (the prefetch window, then doubling), the next
+        // window being selected among the centroids after the last ranked
+        // one when the probes or the prefetches run out of the ranked ones.
+        // Most queries stop within the first window.
+        const bool coarse_ip = quantizer->metric_type == METRIC_INNER_PRODUCT;
+        std::vector<std::pair<float, idx_t>> coarse_win;
+        std::vector<float> coarse_sample;
+        const float *coarse_row = nullptr;
+        // centroids ranked so far, nearest first
+        std::vector<idx_t> coarse_keys;
+        std::vector<float> coarse_keys_dis;
+        idx_t coarse_window = 0;
+
+        auto rank_coarse = [&]() {
+            idx_t ranked = coarse_keys.size();
+            size_t w = std::min(coarse_window, (idx_t)nlist - ranked);
+            bool first = ranked == 0;
+            float last_dis = first ? 0 : coarse_keys_dis.back();
+            idx_t last_id = first ? -1 : coarse_keys.back();
+            if (coarse_ip) {
+                rank_coarse_window<CMin<float, idx_t>>(
+                    nlist, coarse_row, w, first, last_dis, last_id,
+                    coarse_win, coarse_sample);
+            } else {
+                rank_coarse_window<CMax<float, idx_t>>(
+                    nlist, coarse_row, w, first, last_dis, last_id,
+                    coarse_win, coarse_sample);
+            }
+            for (const auto &c : coarse_win) {
+                coarse_keys_dis.push_back(c.first);
+                coarse_keys.push_back(c.second);
+            }
+            coarse_window *= 2;
+        };
+
+        // ranks (at least) the first n centroids
+        auto rank_coarse_upto = [&](idx_t n_ranked) {
+            while ((idx_t)coarse_keys.size() < n_ranked &&
+                   coarse_keys.size() < nlist) {
+                rank_coarse();
+            }
+        };
+
+        // ranks and prefetches the first window
+        auto init_coarse = [&](const float *dis_i) {
+            coarse_row = dis_i;
+            coarse_keys.clear();
+            coarse_keys_dis.clear();
+            coarse_window = prefetch_window;
+            rank_coarse_upto(prefetch_window);
+            invlists->prefetch_lists(coarse_keys.data(), prefetch_window);
+        };
+
+        auto next_coarse = [&](idx_t ik, idx_t &key, float &dis) {
+            rank_coarse_upto(ik + 1);
+            if (ik >= (idx_t)coarse_keys.size()) {
+                key = -1;
+                return;
+            }
+            key = coarse_keys[ik];
+            dis = coarse_keys_dis[ik];
+        };
+
+        // results before the current probe, restored when it triggers the
+        // early stop
+        ConannTopkSnapshot<float, idx_t> prev(early_stop ? k : 0);
+        // centroids of the query past the budget
+        std::vector<idx_t> ext_keys;
+        std::vector<float> ext_dis;
+
         // initialize + reorder a result heap
 
         // NOTE(sonia): initializes the result heap for each query
@@ -1827,16 +3275,6 @@ void IndexIVF::search_preassigned_with_error_quantification(
             }
         };
 
-        auto add_local_results = [&](const float *local_dis,
-                                     const idx_t *local_idx, float *simi,
-                                     idx_t *idxi) {
-            if (metric_type == METRIC_INNER_PRODUCT) {
-                heap_addn<HeapForIP>(k, simi, idxi, local_dis, local_idx, k);
-            } else {
-                heap_addn<HeapForL2>(k, simi, idxi, local_dis, local_idx, k);
-            }
-        };
-
         auto reorder_result = [&](float *simi, idx_t *idxi) {
             if (!do_heap_init)
                 return;
@@ -1875,8 +3313,8 @@ void IndexIVF::search_preassigned_with_error_quantification(
                     std::unique_ptr<InvertedListsIterator> it(
                         invlists->get_iterator(key, inverted_list_context));
 
-                    nheap += scanner->iterate_codes(it.get(), simi, idxi, k,
-                                                    list_size);
+                    nheap += scanner->iterate_codes(it.get(), simi, idxi,
+                                                    k_shortlist, list_size);
 
                     return list_size;
                 } else {
@@ -1912,7 +3350,7 @@ void IndexIVF::search_preassigned_with_error_quantification(
                     }
 
                     nheap += scanner->scan_codes(list_size, codes, ids, simi,
-                                                 idxi, k);
+                                                 idxi, k_shortlist);
 
                     return list_size;
                 }
@@ -1925,6 +3363,52 @@ void IndexIVF::search_preassigned_with_error_quantification(
             }
         };
 
+        // changelog of the query's top-k over the probe steps
+        ConannTopkRecorder topk_recorder;
+
+        auto init_shortlist = [&](const float *xi) {
+            if (metric_type == METRIC_INNER_PRODUCT) {
+                heap_heapify<HeapForIP>(k_shortlist, shortlist_dis.data(),
+                                        shortlist_ids.data());
+            } else {
+                heap_heapify<HeapForL2>(k_shortlist, shortlist_dis.data(),
+                                        shortlist_ids.data());
+            }
+            refine_dc->set_query(xi);
+            reranked.clear();
+        };
+
+        // re-rank the shortlist candidates not seen yet into the result
+        // heap, which therefore only improves as without refinement.
+        // Returns whether it changed.
+        auto rerank_shortlist = [&](float *simi, idx_t *idxi) {
+            bool changed = false;
+            for (idx_t j = 0; j < k_shortlist; j++) {
+                idx_t id = shortlist_ids[j];
+                if (id < 0 || !reranked.insert(id).second) {
+                    continue;
+                }
+                if (id >= ntotal) {
+                    std::lock_guard<std::mutex> lock(exception_mutex);
+                    exception_string = "label " + std::to_string(id) +
+                                       " is not an id of refine_index";
+                    interrupt = true;
+                    continue;
+                }
+                float dis = (*refine_dc)(id);
+                if (metric_type == METRIC_INNER_PRODUCT) {
+                    if (HeapForIP::cmp(simi[0], dis)) {
+                        heap_replace_top<HeapForIP>(k, simi, idxi, dis, id);
+                        changed = true;
+                    }
+                } else if (HeapForL2::cmp(simi[0], dis)) {
+                    heap_replace_top<HeapForL2>(k, simi, idxi, dis, id);
+                    changed = true;
+                }
+            }
+            return changed;
+        };
+
         /****************************************************
          * Actual loops, depending on parallel_mode
          ****************************************************/
@@ -1942,57 +3426,122 @@ void IndexIVF::search_preassigned_with_error_quantification(
                 idx_t *idxi = labels + i * k;
 
                 init_result(simi, idxi);
+                if (refine) {
+                    init_shortlist(x + i * d);
+                }
 
                 idx_t nscan = 0;
-                
 
-                std::vector<faiss::idx_t> prev_idxi(idxi, idxi + k);
-                std::vector<float> prev_simi(simi, simi + k);
-                for (size_t ik = 0; ik < nlist; ik++) {
-                    nscan += scan_one_list(keys[i * nprobe + ik],
-                                           coarse_dis[i * nprobe + ik], simi,
-                                           idxi, max_codes - nscan);
-                    if (nscan >= max_codes) {
-                        break;
+                if (lazy_coarse) {
+                    init_coarse(coarse_dis + i * nlist);
+                }
+
+                if (all_preds_list != nullptr) {
+                    all_preds_list[i].clear();
+                    topk_recorder.clear();
+                }
+
+                prev.reset();
+                idx_t prefetched = prefetch_window;
+                for (idx_t ik = 0; ik < nprobe_max; ik++) {
+                    if (ik == nprobe && !lazy_coarse) {
+                        // the budget ran out before the stop rule fired
+                        ext_keys.resize(nlist - nprobe);
+                        ext_dis.resize(nlist - nprobe);
+                        extend_coarse_assignment(
+                            *quantizer, nlist, 1, x + i * d, nprobe,
+                            keys + i * nprobe, ext_keys.data(),
+                            ext_dis.data(), quantizer_params);
+                    }
+                    if (prefetched < nprobe &&
+                        ik + prefetch_window / 2 >= prefetched) {
+                        // half way through the window: prefetch the next one
+                        idx_t n_next =
+                            std::min(prefetch_window, nprobe - prefetched);
+                        if (lazy_coarse) {
+                            rank_coarse_upto(prefetched + n_next);
+                            invlists->prefetch_lists(
+                                coarse_keys.data() + prefetched, n_next);
+                        } else {
+                            invlists->prefetch_lists(
+                                keys + i * nprobe + prefetched, n_next);
+                        }
+                        prefetched += n_next;
+                    }
+                    if (early_stop) {
+                        // the k-th distance can only decrease, so this probe
+                        // would be rolled back anyway: stop before scanning it
+                        if (kth_is_root && simi[0] <= stop_thresholds[ik]) {
+                            break;
+                        }
+                        prev.save(k, simi, idxi);
                     }
 
-                    // Find largest score corresponding to the kth closest
-                    // vector. Needed because FAISS does not maintain them
-                    // ordered.
-                    float score_k = *std::max_element(simi, simi + k);
+                    idx_t key = -1;
+                    float key_dis = 0;
+                    if (lazy_coarse) {
+                        next_coarse(ik, key, key_dis);
+                    } else if (ik < nprobe) {
+                        key = keys[i * nprobe + ik];
+                        key_dis = coarse_dis[i * nprobe + ik];
+                    } else {
+                        key = ext_keys[ik - nprobe];
+                        key_dis = ext_dis[ik - nprobe];
+                    }
+
+                    size_t nheap0 = nheap;
+                    if (refine) {
+                        nscan += scan_one_list(key, key_dis,
+                                               shortlist_dis.data(),
+                                               shortlist_ids.data(),
+                                               max_codes - nscan);
+                    } else {
+                        nscan += scan_one_list(key, key_dis, simi, idxi,
+                                               max_codes - nscan);
+                    }
+
+                    bool heap_changed = nheap != nheap0;
+                    if (refine && heap_changed) {
+                        heap_changed = rerank_shortlist(simi, idxi);
+                    }
+                    float score_k = kth_score(simi);
 
                     if (all_preds_list == nullptr) {
-                        // NOTE: early stopping mode, code used for search_conann only
-                        // check for early stopping; need to attempt to regularize the score
-                        if (cal_params.lamhat <= 1) {
-                            float max_reg_val = (1 + cal_params.regLambda * (nlist - cal_params.kreg)) + 10;
-                            float nonconf_score = std::min(score_k / MAX_DISTANCE, 1.0f);
-                            float reg_score_k = (1 - nonconf_score) + compute_regularization(ik + 1, cal_params.regLambda, cal_params.kreg);
-                            reg_score_k = reg_score_k / max_reg_val;
-                            if (reg_score_k > cal_params.lamhat) {
-                                // We have searched one cluster more than needed so we can return the results of the previous iteration
-                                std::memcpy(idxi, prev_idxi.data(), prev_idxi.size() * sizeof(idx_t));
-                                std::memcpy(simi, prev_simi.data(), prev_simi.size() * sizeof(float));
-                                break;
-                            } 
+                        if (nscan >= max_codes) {
+                            // out of codes: the last list is kept
+                            break;
                         }
+                        if (!early_stop) {
+                            continue;
+                        }
+                        if (score_k <= stop_thresholds[ik]) {
+                            // We have searched one cluster more than needed so
+                            // we return the results of the previous iteration
+                            prev.restore(k, heap_changed, simi, idxi);
+                            break;
+                        }
+                        prev.update(heap_changed);
                     } else {
-                        std::vector<faiss::idx_t> idxi_copy(idxi, idxi + k);
-
-                        // add results for query i
-                        (*(all_preds_list + i))[keys[i * nprobe + ik]] = idxi_copy;
+                        // add results for query i, only when the top-k changed
+                        if (heap_changed) {
+                            topk_recorder.record(ik, k, simi, idxi, nlist,
+                                                 all_preds_list[i]);
+                        }
                         if (score_k > MAX_DISTANCE) {
-                            (*(nonconf_list + i))[keys[i * nprobe + ik]] = 1.0;
+                            (*(nonconf_list + i))[ik] = 1.0;
                         } else {
-                            (*(nonconf_list + i))[keys[i * nprobe + ik]] =
-                                score_k / MAX_DISTANCE;
+                            (*(nonconf_list + i))[ik] = score_k / MAX_DISTANCE;
+                        }
+                        if (nscan >= max_codes) {
+                            // the search stops after this list: the later
+                            // ranks keep its top-k and its score
+                            std::fill(nonconf_list[i].begin() + ik + 1,
+                                      nonconf_list[i].end(),
+                                      nonconf_list[i][ik]);
+                            break;
                         }
                     }
-                    // keep the results of this iteration in case of early stopping
-                    std::memcpy(prev_idxi.data(), idxi, k * sizeof(idx_t));
-                    std::memcpy(prev_simi.data(), simi, k * sizeof(float));
                 }
-                
 
                 ndis += nscan;
                 reorder_result(simi, idxi);
@@ -2002,8 +3551,172 @@ void IndexIVF::search_preassigned_with_error_quantification(
                 }
 
             } // parallel for
+        } else if (intra_query) {
+            // Speculative intra-query parallelism, for small batches. The
+            // lists of a query are scanned in rounds of round_width (one per
+            // thread) into private heaps. The master thread then merges them
+            // in probe order and applies the stopping rule after each list,
+            // as the sequential loop does: the results are the same, at the
+            // cost of scanning up to round_width - 1 lists past the stop.
+#pragma omp master
+            {
+                round_width = omp_get_num_threads();
+                round_dis.resize(round_width * k);
+                round_ids.resize(round_width * k);
+            }
+#pragma omp barrier
+
+            // merge the results of one list into the query's heap, returns
+            // the nb of insertions
+            auto merge_list = [&](const float *ldis, const idx_t *lids,
+                                  float *simi, idx_t *idxi) {
+                size_t n_ins = 0;
+                for (idx_t j = 0; j < k; j++) {
+                    if (lids[j] < 0) {
+                        continue;
+                    }
+                    if (metric_type == METRIC_INNER_PRODUCT) {
+                        if (HeapForIP::cmp(simi[0], ldis[j])) {
+                            heap_replace_top<HeapForIP>(k, simi, idxi, ldis[j],
+                                                        lids[j]);
+                            n_ins++;
+                        }
+                    } else if (HeapForL2::cmp(simi[0], ldis[j])) {
+                        heap_replace_top<HeapForL2>(k, simi, idxi, ldis[j],
+                                                    lids[j]);
+                        n_ins++;
+                    }
+                }
+                return n_ins;
+            };
+
+            for (idx_t i = 0; i < n; i++) {
+                scanner->set_query(x + i * d);
+                float *simi = distances + i * k;
+                idx_t *idxi = labels + i * k;
+                idx_t prefetched = prefetch_window;
+
+#pragma omp master
+                {
+                    init_result(simi, idxi);
+                    prev.reset();
+                    if (all_preds_list != nullptr) {
+                        all_preds_list[i].clear();
+                        topk_recorder.clear();
+                    }
+                    round_stop = interrupt;
+                    round_nprobe = nprobe;
+                }
+#pragma omp barrier
+
+                for (idx_t ik0 = 0; ik0 < round_nprobe && !round_stop;
+                     ik0 = round_next) {
+#pragma omp for schedule(static, 1)
+                    for (int t = 0; t < round_width; t++) {
+                        float *ldis = round_dis.data() + t * k;
+                        idx_t *lids = round_ids.data() + t * k;
+                        if (metric_type == METRIC_INNER_PRODUCT) {
+                            heap_heapify<HeapForIP>(k, ldis, lids);
+                        } else {
+                            heap_heapify<HeapForL2>(k, ldis, lids);
+                        }
+                        idx_t ik = ik0 + t;
+                        if (ik < nprobe) {
+                            ndis += scan_one_list(
+                                keys[i * nprobe + ik],
+                                coarse_dis[i * nprobe + ik], ldis, lids,
+                                unlimited_list_size);
+                        } else if (ik < round_nprobe) {
+                            ndis += scan_one_list(
+                                round_ext_keys[ik - nprobe],
+                                round_ext_dis[ik - nprobe], ldis, lids,
+                                unlimited_list_size);
+                        }
+                    }
+
+#pragma omp master
+                    {
+                        if (prefetched < nprobe &&
+                            ik0 + round_width + prefetch_window / 2 >=
+                                prefetched) {
+                            idx_t n_next =
+                                std::min(std::max(prefetch_window,
+                                                  (idx_t)round_width),
+                                         nprobe - prefetched);
+                            invlists->prefetch_lists(
+                                keys + i * nprobe + prefetched, n_next);
+                            prefetched += n_next;
+                        }
+                        for (int t = 0; t < round_width; t++) {
+                            idx_t ik = ik0 + t;
+                            if (ik >= round_nprobe) {
+                                break;
+                            }
+                            if (early_stop) {
+                                if (kth_is_root &&
+                                    simi[0] <= stop_thresholds[ik]) {
+                                    round_stop = true;
+                                    break;
+                                }
+                                prev.save(k, simi, idxi);
+                            }
+                            bool heap_changed =
+                                merge_list(round_dis.data() + t * k,
+                                           round_ids.data() + t * k, simi,
+                                           idxi) > 0;
+                            float score_k = kth_score(simi);
+
+                            if (all_preds_list == nullptr) {
+                                if (early_stop &&
+                                    score_k <= stop_thresholds[ik]) {
+                                    prev.restore(k, heap_changed, simi, idxi);
+                                    round_stop = true;
+                                    break;
+                                }
+                                prev.update(heap_changed);
+                            } else {
+                                if (heap_changed) {
+                                    topk_recorder.record(
+                                        ik, k, simi, idxi, nlist,
+                                        all_preds_list[i]);
+                                }
+                                if (score_k > MAX_DISTANCE) {
+                                    (*(nonconf_list + i))[ik] = 1.0;
+                                } else {
+                                    (*(nonconf_list + i))[ik] =
+                                        score_k / MAX_DISTANCE;
+                                }
+                            }
+                        }
+                        round_stop = round_stop || interrupt;
+                        round_next = std::min(ik0 + round_width, round_nprobe);
+                        if (!round_stop && round_next == nprobe &&
+                            nprobe < nprobe_max) {
+                            // the budget ran out before the stop rule fired
+                            round_ext_keys.resize(nlist - nprobe);
+                            round_ext_dis.resize(nlist - nprobe);
+                            extend_coarse_assignment(
+                                *quantizer, nlist, 1, x + i * d, nprobe,
+                                keys + i * nprobe, round_ext_keys.data(),
+                                round_ext_dis.data(), quantizer_params);
+                            round_nprobe = nprobe_max;
+                        }
+                    }
+#pragma omp barrier
+                }
+                // all the threads are out of the rounds before the master
+                // resets round_stop and round_nprobe for the next query
+#pragma omp barrier
+
+#pragma omp master
+                {
+                    reorder_result(simi, idxi);
+                    if (InterruptCallback::is_interrupted()) {
+                        interrupt = true;
+                    }
+                }
+            }
         }
-        // TODO(sonia): other parallel modes
     } // parallel section
 
     if (interrupt) {
@@ -2024,6 +3737,302 @@ void IndexIVF::search_preassigned_with_error_quantification(
     ivf_stats->nheap_updates += nheap;
 }
 
+void IndexIVF::search_cluster_major_with_error_quantification(
+    const float *stop_thresholds, idx_t n, const float *x, idx_t k,
+    float *distances, idx_t *labels, const IVFSearchParameters *params,
+    IndexIVFStats *ivf_stats) const {
+    const size_t nprobe =
+        std::min(nlist, params ? params->nprobe : this->nprobe);
+    FAISS_THROW_IF_NOT(nprobe > 0);
+    FAISS_THROW_IF_NOT_MSG(!invlists->use_iterator,
+                           "iterable inverted lists not supported by the "
+                           "cluster-major search");
+    FAISS_THROW_IF_NOT_MSG(!refine_index,
+                           "refine_index not supported by the cluster-major "
+                           "search");
+    size_t max_codes = params ? params->max_codes : this->max_codes;
+    if (max_codes == 0) {
+        max_codes = std::numeric_limits<size_t>::max();
+    }
+    IDSelector *sel = params ? params->sel : nullptr;
+    void *inverted_list_context =
+        params ? params->inverted_list_context : nullptr;
+
+    double t0 = getmillisecs();
+    std::unique_ptr<idx_t[]> keys(new idx_t[n * nprobe]);
+    std::unique_ptr<float[]> coarse_dis(new float[n * nprobe]);
+    quantizer->search(n, x, nprobe, coarse_dis.get(), keys.get(),
+                      params ? params->quantizer_params : nullptr);
+    double t1 = getmillisecs();
+
+    using HeapForIP = CMin<float, idx_t>;
+    using HeapForL2 = CMax<float, idx_t>;
+    const bool early_stop = stop_thresholds != nullptr;
+    const bool kth_is_root = metric_type != METRIC_INNER_PRODUCT;
+
+    // same prefetching as the query-major search, by probe rounds: the first
+    // window upfront, the next one for the active queries half way through
+    auto cparams = dynamic_cast<const SearchParametersConann *>(params);
+    const size_t window = cparams && early_stop && cparams->prefetch_nprobe > 0
+                              ? std::min(nprobe, cparams->prefetch_nprobe)
+                              : nprobe;
+    std::vector<idx_t> prefetch_keys;
+    auto prefetch_rounds = [&](const idx_t *queries, size_t nq, size_t r0,
+                               size_t r1) {
+        prefetch_keys.clear();
+        for (size_t q = 0; q < nq; q++) {
+            idx_t i = queries ? queries[q] : q;
+            prefetch_keys.insert(prefetch_keys.end(),
+                                 keys.get() + i * nprobe + r0,
+                                 keys.get() + i * nprobe + r1);
+        }
+        invlists->prefetch_lists(prefetch_keys.data(), prefetch_keys.size());
+    };
+    prefetch_rounds(nullptr, n, 0, window);
+    size_t prefetched = window;
+
+    // the queries still active once the budget is spent continue on the
+    // rest of the centroids, as in the query-major search
+    const size_t nprobe_max =
+        early_stop && cparams && cparams->extend_budget ? nlist : nprobe;
+    std::vector<idx_t> ext_row(n, -1), ext_keys;
+    std::vector<float> ext_dis;
+    auto extend_active = [&](const std::vector<idx_t> &queries) {
+        size_t nq = queries.size(), next = nlist - nprobe;
+        std::vector<float> xa(nq * d);
+        std::vector<idx_t> keys_a(nq * nprobe);
+        for (size_t q = 0; q < nq; q++) {
+            idx_t i = queries[q];
+            std::memcpy(xa.data() + q * d, x + i * d, d * sizeof(float));
+            std::memcpy(keys_a.data() + q * nprobe, keys.get() + i * nprobe,
+                        nprobe * sizeof(idx_t));
+            ext_row[i] = q;
+        }
+        ext_keys.resize(nq * next);
+        ext_dis.resize(nq * next);
+        extend_coarse_assignment(*quantizer, nlist, nq, xa.data(), nprobe,
+                                 keys_a.data(), ext_keys.data(),
+                                 ext_dis.data(),
+                                 params ? params->quantizer_params : nullptr);
+    };
+    auto probe_key = [&](idx_t i, size_t ik) {
+        return ik < nprobe ? keys[i * nprobe + ik]
+                           : ext_keys[ext_row[i] * (nlist - nprobe) + ik -
+                                      nprobe];
+    };
+    auto probe_dis = [&](idx_t i, size_t ik) {
+        return ik < nprobe ? coarse_dis[i * nprobe + ik]
+                           : ext_dis[ext_row[i] * (nlist - nprobe) + ik -
+                                     nprobe];
+    };
+
+    for (idx_t i = 0; i < n; i++) {
+        if (metric_type == METRIC_INNER_PRODUCT) {
+            heap_heapify<HeapForIP>(k, distances + i * k, labels + i * k);
+        } else {
+            heap_heapify<HeapForL2>(k, distances + i * k, labels + i * k);
+        }
+    }
+
+    // results before the current round, restored when it triggers the stop
+    std::vector<float> prev_simi(early_stop ? n * k : 0);
+    std::vector<idx_t> prev_idxi(early_stop ? n * k : 0);
+    std::vector<uint8_t> prev_stale(n, 1);
+    std::vector<size_t> nscan(n);
+
+    // queries still probing, and the (list, query) pairs of the current round
+    std::vector<idx_t> active(n);
+    std::iota(active.begin(), active.end(), 0);
+    std::vector<uint8_t> done(n);
+    std::vector<std::pair<idx_t, idx_t>> visits;
+    // work items: ranges of visits on the same list. The large groups are
+    // split so that their queries are shared between the threads.
+    std::vector<size_t> item_begin;
+
+    // the lists are scanned in tiles of codes that stay in cache while all
+    // the queries of the work item go over them
+    const size_t tile_size =
+        std::max(size_t(1), (size_t(1) << 16) / code_size);
+
+    // one scanner per query of a work item, so that the query-dependent
+    // tables are computed once per round, not once per tile
+    const int nt = omp_get_max_threads();
+    std::vector<std::vector<std::unique_ptr<InvertedListScanner>>> scanners(
+        nt);
+
+    size_t nlistv = 0, ndis = 0, nheap = 0;
+    std::mutex exception_mutex;
+    std::string exception_string;
+
+    for (size_t ik = 0; ik < nprobe_max && !active.empty(); ik++) {
+        if (ik == nprobe) {
+            extend_active(active);
+        }
+        if (prefetched < nprobe && ik + window / 2 >= prefetched) {
+            size_t r1 = std::min(nprobe, prefetched + window);
+            prefetch_rounds(active.data(), active.size(), prefetched, r1);
+            prefetched = r1;
+        }
+
+        visits.clear();
+        for (idx_t i : active) {
+            // the k-th distance can only decrease: this round would be
+            // rolled back anyway
+            if (early_stop && kth_is_root &&
+                distances[i * k] <= stop_thresholds[ik]) {
+                done[i] = 1;
+                continue;
+            }
+            visits.emplace_back(probe_key(i, ik), i);
+        }
+        std::sort(visits.begin(), visits.end());
+        const size_t chunk =
+            nt > 1 ? std::max(size_t(16), visits.size() / (4 * nt))
+                   : visits.size();
+        item_begin.clear();
+        for (size_t v = 0; v < visits.size(); v++) {
+            if (v == 0 || visits[v].first != visits[v - 1].first ||
+                v - item_begin.back() == chunk) {
+                item_begin.push_back(v);
+            }
+        }
+        item_begin.push_back(visits.size());
+        idx_t nitem = item_begin.size() - 1;
+
+#pragma omp parallel if (nitem > 1) reduction(+ : nlistv, ndis, nheap)
+        {
+            auto &pool = scanners[omp_get_thread_num()];
+            std::vector<size_t> n_updates, limits;
+
+#pragma omp for schedule(dynamic)
+            for (idx_t it = 0; it < nitem; it++) {
+                const std::pair<idx_t, idx_t> *group =
+                    visits.data() + item_begin[it];
+                size_t gsize = item_begin[it + 1] - item_begin[it];
+                idx_t key = group[0].first;
+                n_updates.assign(gsize, 0);
+                limits.assign(gsize, 0);
+
+                for (size_t j = 0; early_stop && j < gsize; j++) {
+                    idx_t i = group[j].second;
+                    if (prev_stale[i]) {
+                        std::memcpy(prev_simi.data() + i * k,
+                                    distances + i * k, k * sizeof(float));
+                        std::memcpy(prev_idxi.data() + i * k, labels + i * k,
+                                    k * sizeof(idx_t));
+                        prev_stale[i] = 0;
+                    }
+                }
+
+                // key < 0: not enough centroids, nothing to scan
+                if (key >= 0 &&
+                    !invlists->is_empty(key, inverted_list_context)) {
+                    try {
+                        size_t list_size = invlists->list_size(key);
+                        size_t list_scan = 0;
+                        while (pool.size() < gsize) {
+                            pool.emplace_back(
+                                get_InvertedListScanner(false, sel));
+                        }
+                        for (size_t j = 0; j < gsize; j++) {
+                            idx_t i = group[j].second;
+                            limits[j] = std::min(list_size,
+                                                 max_codes - nscan[i]);
+                            list_scan = std::max(list_scan, limits[j]);
+                            pool[j]->set_query(x + i * d);
+                            pool[j]->set_list(key, probe_dis(i, ik));
+                        }
+                        InvertedLists::ScopedCodes scodes(invlists, key);
+                        InvertedLists::ScopedIds sids(invlists, key);
+                        for (size_t j0 = 0; j0 < list_scan; j0 += tile_size) {
+                            size_t j1 = std::min(list_scan, j0 + tile_size);
+                            for (size_t j = 0; j < gsize; j++) {
+                                if (limits[j] <= j0) {
+                                    continue;
+                                }
+                                idx_t i = group[j].second;
+                                n_updates[j] += pool[j]->scan_codes(
+                                    std::min(j1, limits[j]) - j0,
+                                    scodes.get() + j0 * code_size,
+                                    sids.get() + j0, distances + i * k,
+                                    labels + i * k, k);
+                            }
+                        }
+                        for (size_t j = 0; j < gsize; j++) {
+                            nscan[group[j].second] += limits[j];
+                            ndis += limits[j];
+                        }
+                        nlistv += gsize;
+                    } catch (const std::exception &e) {
+                        std::lock_guard<std::mutex> lock(exception_mutex);
+                        exception_string =
+                            demangle_cpp_symbol(typeid(e).name()) + "  " +
+                            e.what();
+                    }
+                }
+
+                for (size_t j = 0; j < gsize; j++) {
+                    idx_t i = group[j].second;
+                    float *simi = distances + i * k;
+                    nheap += n_updates[j];
+                    // out of codes: the last list is kept, as in the
+                    // query-major search
+                    if (nscan[i] >= max_codes) {
+                        done[i] = 1;
+                        continue;
+                    }
+                    if (!early_stop) {
+                        continue;
+                    }
+                    bool heap_changed = n_updates[j] > 0;
+                    float score_k = kth_is_root
+                                        ? simi[0]
+                                        : *std::max_element(simi, simi + k);
+                    if (score_k <= stop_thresholds[ik]) {
+                        if (heap_changed) {
+                            std::memcpy(simi, prev_simi.data() + i * k,
+                                        k * sizeof(float));
+                            std::memcpy(labels + i * k,
+                                        prev_idxi.data() + i * k,
+                                        k * sizeof(idx_t));
+                        }
+                        done[i] = 1;
+                    } else if (heap_changed) {
+                        prev_stale[i] = 1;
+                    }
+                }
+            }
+        }
+
+        if (!exception_string.empty()) {
+            FAISS_THROW_FMT("search interrupted with: %s",
+                            exception_string.c_str());
+        }
+        if (InterruptCallback::is_interrupted()) {
+            FAISS_THROW_MSG("computation interrupted");
+        }
+        // retire the queries whose stopping rule fired
+        active.erase(std::remove_if(active.begin(), active.end(),
+                                    [&](idx_t i) { return done[i] != 0; }),
+                     active.end());
+    }
+
+    for (idx_t i = 0; i < n; i++) {
+        if (metric_type == METRIC_INNER_PRODUCT) {
+            heap_reorder<HeapForIP>(k, distances + i * k, labels + i * k);
+        } else {
+            heap_reorder<HeapForL2>(k, distances + i * k, labels + i * k);
+        }
+    }
+
+    ivf_stats->nq += n;
+    ivf_stats->nlist += nlistv;
+    ivf_stats->ndis += ndis;
+    ivf_stats->nheap_updates += nheap;
+    ivf_stats->quantization_time += t1 - t0;
+    ivf_stats->search_time += getmillisecs() - t0;
+}
+
 idx_t IndexIVF::train_encoder_num_vectors() const { return 0; }
 
 void IndexIVF::train_encoder(idx_t /*n*/, const float * /*x*/,
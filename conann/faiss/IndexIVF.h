@@ -11,6 +11,7 @@
 #define FAISS_INDEX_IVF_H
 
 #include <faiss/Clustering.h>
+#include <faiss/ConannPredictions.h>
 #include <faiss/Index.h>
 #include <faiss/IndexFlat.h>
 #include <faiss/impl/IDSelector.h>
@@ -20,6 +21,7 @@
 #include <faiss/utils/Heap.h>
 #include <stdint.h>
 
+#include <functional>
 #include <map>
 #include <memory>
 #include <unordered_map>
@@ -80,9 +82,26 @@ struct SearchParametersIVF : SearchParameters {
 // the new convention puts the index type after SearchParameters
 using IVFSearchParameters = SearchParametersIVF;
 
+/// parameters of the early-stopping ConANN search
+struct SearchParametersConann : SearchParametersIVF {
+    /// lists prefetched upfront per query. Then, as a query keeps probing,
+    /// its next prefetch_nprobe lists are prefetched when it is half way
+    /// through the current window. 0 = all nprobe lists upfront.
+    size_t prefetch_nprobe = 0;
+    /// a query that probed its nprobe lists without the stop rule firing
+    /// goes on with the rest of its centroids (up to nlist) instead of
+    /// stopping at the budget. nprobe is then a prefetch and coarse
+    /// assignment size rather than a hard cap, and the FNR guarantee holds
+    /// for the queries that need more probes than the calibration ones.
+    bool extend_budget = true;
+
+    ~SearchParametersConann() override {}
+};
+
 struct InvertedListScanner;
 struct IndexIVFStats;
 struct CodePacker;
+struct ConannCacheFile;
 
 struct IndexIVFInterface : Level1Quantizer {
     size_t nprobe = 1;    ///< number of probes at query time
@@ -400,6 +419,43 @@ struct IndexIVF : Index, IndexIVFInterface {
     std::vector<std::vector<float>> centroids;
     std::string dataset_name;
     bool enable_cache = false;
+    // true: compute lamhat exactly by sweeping the breakpoints of the FNR step
+    // function. false: use GSL Brent root finding on the same function.
+    bool exact_lamhat = true;
+    // > 0: prep_execution scores the queries in blocks of this size and only
+    // keeps their scores and ground-truth hits, so the predictions of all
+    // the queries are never held in memory at once (the cache is not
+    // written in this mode). 0: all the queries at once.
+    size_t calibration_block_size = 0;
+    // lambda_reg candidates tried by pick_lambda_reg on the tune split
+    std::vector<float> lambda_reg_grid = {0.0, 0.001, 0.01, 0.1};
+    // search_conann with a flat quantizer: the distances to all the
+    // centroids are computed with BLAS for blocks of queries, but they are
+    // ranked one window at a time (starting with the prefetch window) as the
+    // probe loop needs them or prefetches their lists, instead of selecting
+    // nprobe of them upfront
+    bool lazy_coarse_assignment = false;
+    // search_conann on large batches: advance all the queries in probe
+    // rounds, and scan each inverted list of a round once for the group of
+    // queries that probe it, instead of once per query. Needs an index with
+    // an InvertedListScanner (not the fast-scan ones).
+    bool cluster_major_search = false;
+    // search_conann: the queries that exhaust nprobe_budget without the stop
+    // rule firing rank the rest of the centroids and keep probing (see
+    // SearchParametersConann::extend_budget). With false, nprobe_budget is a
+    // hard cap and the FNR guarantee only holds for queries that need no
+    // more probes than the calibration ones.
+    bool extend_nprobe_budget = true;
+    // ConANN with a lossy codec: the probe loop keeps a shortlist of the
+    // refine_k_factor * k best code distances and re-ranks its candidates
+    // with refine_index (exact or finer distances, same ids as this index,
+    // not owned). The results, the stopping rule and the calibration scores
+    // all use the refined distances.
+    const Index *refine_index = nullptr;
+    float refine_k_factor = 4;
+    // quantile of the nb of clusters probed per calibration query used as
+    // the upfront prefetch window (CalibrationResults::nprobe_prefetch)
+    float prefetch_quantile = 0.9;
 
     // for convenience
     double elapsed();
@@ -414,19 +470,57 @@ struct IndexIVF : Index, IndexIVFInterface {
     std::vector<std::vector<faiss::idx_t>> tune_labels;
     std::vector<std::vector<faiss::idx_t>> test_labels;
 
-    // The nonconformity scores assigned to all clusters per query (nq * nlist).
+    // The nonconformity scores after each probe step per query (nq * nlist),
+    // indexed by probe rank (entry j: after the j+1 nearest clusters).
     std::vector<std::vector<float>> calib_nonconf;
     std::vector<std::vector<float>> tune_nonconf;
     std::vector<std::vector<float>> test_nonconf;
 
     // The predicted vector ids of all K neighbors for each query for increasing
-    // nprobe values. This stores all incremental search results as nprobe is
-    // increased from 1 to nlist. shape: nq * nlist * k
-    std::vector<std::vector<std::vector<faiss::idx_t>>> calib_preds;
-    std::vector<std::vector<std::vector<faiss::idx_t>>> tune_preds;
-    std::vector<std::vector<std::vector<faiss::idx_t>>> test_preds;
+    // nprobe values, stored as a per-query changelog of top-k insertions and
+    // evictions (see ConannPredictions). The calib/tune/test splits are views
+    // into all_preds, or into cache_file when it was read from the cache
+    // (no copies).
+    ConannPredictions all_preds;
+    std::shared_ptr<const ConannCacheFile> cache_file;
+    ConannPredictionsView calib_preds;
+    ConannPredictionsView tune_preds;
+    ConannPredictionsView test_preds;
+
+    /** Ground-truth hits of each query along the probe order.
+     *
+     * events[offsets[q] .. offsets[q + 1]) are (step, delta) pairs sorted by
+     * step: after probe step `step`, the nb of ground-truth neighbors in the
+     * top-k of query q changes by delta. This is all the calibration needs
+     * from the predictions, in O(k) per query.
+     */
+    struct GtHits {
+        size_t k = 0;        ///< ground-truth size of the first query
+        size_t total_gt = 0; ///< sum of the ground-truth set sizes
+        std::vector<idx_t> offsets = {0};
+        std::vector<std::pair<int32_t, int32_t>> events;
+
+        size_t size() const { return offsets.size() - 1; }
+
+        /// append the queries of another block
+        void append(const GtHits &other);
+    };
 
-    // performance heavy pre-computation of scores, uses cache if possible
+    // Computed in prep_execution. In streaming mode (calibration_block_size
+    // > 0) the *_preds views are empty and only these are kept.
+    GtHits calib_hits;
+    GtHits tune_hits;
+    GtHits test_hits;
+
+    /** Fingerprint of everything the calibration sweep depends on: the
+     * centroids, the inverted list sizes, the queries, the metric and the
+     * ConANN parameters. Used as the cache key, so a retrained or refilled
+     * index, or another query set, never reuses stale scores.
+     */
+    uint64_t conann_fingerprint(const float *queries, size_t nq) const;
+
+    // performance heavy pre-computation of scores, uses cache if possible.
+    // gt == nullptr: see sweep_ground_truth
     void prep_execution(float alpha, float calib_sz, float tune_sz,
                         const float *queries, size_t nq,
                         const faiss::idx_t *gt);
@@ -435,6 +529,13 @@ struct IndexIVF : Index, IndexIVFInterface {
         float lamhat;
         int kreg;
         float regLambda;
+        // nb of clusters ranked upfront by search_conann for each query
+        // (max nb probed on the calibration splits), 0 = nlist. The queries
+        // that need more go on past it, see extend_nprobe_budget.
+        int nprobe_budget = 0;
+        // lists prefetched upfront per query (prefetch_quantile of the nb of
+        // clusters probed on the calibration queries), 0 = nprobe_budget
+        int nprobe_prefetch = 0;
     };                 
 
     struct TimeReport {
@@ -449,42 +550,202 @@ struct IndexIVF : Index, IndexIVFInterface {
     };
     TimeReport time_report;
 
-    std::tuple<std::vector<std::vector<float>>,
-               std::vector<std::vector<std::vector<faiss::idx_t>>>>
+    // result of the last calibrate(). Stored by write_index with
+    // IO_FLAG_CONANN_CALIBRATION (fourcc "CnAN"), so a read index can serve
+    // search_conann without recalibrating.
+    bool is_calibrated = false;
+    CalibrationResults calibration = {2, 0, 0};
+
+    // stopping thresholds of the last CalibrationResults passed to
+    // get_stop_thresholds, shared read-only by the search threads
+    std::vector<float> stop_thresholds;
+    CalibrationResults stop_thresholds_params = {2, 0, 0};
+    float stop_thresholds_max_distance = 0;
+
+    /** Empirical FNR as a function of the threshold lambda.
+     *
+     * For query q, scores[q * nlist + i] are its regularized nonconformity
+     * scores sorted in ascending order, and hits[q * nlist + i] is the number
+     * of ground-truth neighbors found when the query stops after the probe
+     * step of the i-th sorted score. Built once per (scores, labels) pair,
+     * after which each FNR evaluation is one binary search per query.
+     */
+    struct FnrStepFunction {
+        size_t nq = 0;
+        size_t nlist = 0;
+        std::vector<float> scores;  ///< nq * nlist, sorted per query
+        std::vector<int32_t> hits;  ///< nq * nlist
+        size_t total_gt = 0;        ///< sum of the ground-truth set sizes
+        size_t k = 0;               ///< ground-truth size of the first query
+
+        /// same value as false_negative_rate(compute_predictions(lambda))
+        double fnr(float lambda) const;
+
+        /// per-query FNR and nb of clusters searched (-1 if none) at lambda,
+        /// same values as evaluate()
+        void evaluate(float lambda, std::vector<float> &fnrs,
+                      std::vector<int> &cl_searched) const;
+
+        /** smallest lambda with fnr(lambda) <= target_fnr
+         *
+         * The breakpoints of all queries are merged and swept once in
+         * ascending order. Returns `not_found` if no lambda is admissible.
+         */
+        float min_admissible_lambda(float target_fnr,
+                                    float not_found = 1.0f) const;
+    };
+
+    /// conformal risk control target FNR for n calibration queries
+    static float conformal_target_fnr(float alpha, size_t n);
+
+    /// lamhat for the target FNR (exact or Brent, see exact_lamhat).
+    /// Thread-safe: does not touch the index state.
+    float find_lamhat(const FnrStepFunction &fnr_curve, float target_fnr) const;
+
+    FnrStepFunction compute_fnr_step_function(
+        const std::vector<std::vector<faiss::idx_t>> &labels,
+        const std::vector<std::vector<float>> &reg_nonconf,
+        const ConannPredictionsView &preds) const;
+
+    FnrStepFunction compute_fnr_step_function(
+        const std::vector<std::vector<float>> &reg_nonconf,
+        const GtHits &gt_hits) const;
+
+    /** ground truth read from the calibration sweep itself: the top-k of
+     * preds query q once all the lists are probed, stored (unordered) in
+     * labels[label0 + q]. This is the exact kNN for IndexIVFFlat; for lossy
+     * codecs it is the exhaustive search of the codec, which is what
+     * search_conann approximates.
+     */
+    void sweep_ground_truth(const ConannPredictionsView &preds,
+                            std::vector<std::vector<faiss::idx_t>> &labels,
+                            size_t label0 = 0) const;
+
+    /// hits of preds query q against labels[label0 + q]
+    GtHits compute_gt_hits(
+        const std::vector<std::vector<faiss::idx_t>> &labels,
+        const ConannPredictionsView &preds, size_t label0 = 0) const;
+
+    /// full nprobe = nlist sweep of the queries. Only reads the index, so
+    /// it may run concurrently with searches.
+    std::tuple<std::vector<std::vector<float>>, ConannPredictions>
     compute_scores(CalibrationResults cal_params, faiss::idx_t num_queries,
-                   const float *queries);
+                   const float *queries) const;
+
+    /// scores and predictions that a sweep with K = k would produce, derived
+    /// from the sweep preds (of a larger K) and its scores nonconf
+    std::tuple<std::vector<std::vector<float>>, ConannPredictions>
+    restrict_scores(const std::vector<std::vector<float>> &nonconf,
+                    const ConannPredictionsView &preds, size_t k) const;
 
     std::pair<std::vector<std::vector<faiss::idx_t>>, std::vector<int>>
     compute_predictions(
         float lambda,
         const std::vector<std::vector<float>> &nonconf,
-        const std::vector<std::vector<std::vector<faiss::idx_t>>> &preds);
+        const ConannPredictionsView &preds);
 
+    /// stop_thresholds: per-probe-rank table from compile_stop_thresholds,
+    /// nullptr to probe all lists (calibration mode).
+    /// In the preassigned version, assign == nullptr ranks the centroids
+    /// lazily: centroid_dis then holds the distances of each query to all
+    /// the nlist centroids (n * nlist).
     void search_with_error_quantification(
-        CalibrationResults cal_params, idx_t n, const float *x, idx_t k, float *distances,
+        const float *stop_thresholds, idx_t n, const float *x, idx_t k, float *distances,
         idx_t *labels, std::vector<float> *nonconf_list,
-        std::vector<std::vector<faiss::idx_t>> *all_preds_list,
+        std::vector<ConannTopkEntry> *all_preds_list,
         const SearchParameters *params = nullptr) const;
 
+    /// search_with_error_quantification of n queries in the calling thread.
+    /// Indexes that do not scan with an InvertedListScanner (fast-scan)
+    /// override it with their own probe loop.
+    virtual void search_slice_with_error_quantification(
+        const float *stop_thresholds, idx_t n, const float *x, idx_t k,
+        float *distances, idx_t *labels, std::vector<float> *nonconf_list,
+        std::vector<ConannTopkEntry> *all_preds_list,
+        const IVFSearchParameters *params, IndexIVFStats *ivf_stats) const;
+
     void search_preassigned_with_error_quantification(
-        CalibrationResults cal_params, idx_t n, const float *x, idx_t k, const idx_t *assign,
+        const float *stop_thresholds, idx_t n, const float *x, idx_t k, const idx_t *assign,
         const float *centroid_dis, float *distances, idx_t *labels,
         bool store_pairs, std::vector<float> *nonconf_list,
-        std::vector<std::vector<faiss::idx_t>> *all_preds_list,
+        std::vector<ConannTopkEntry> *all_preds_list,
         const IVFSearchParameters *params = nullptr,
         IndexIVFStats *stats = nullptr) const;
 
+    /// early-stopping search of the whole batch in probe rounds: at round ik
+    /// the active queries are grouped by their ik-th list, each list is
+    /// scanned once per group (in tiles of codes, with one scanner per query
+    /// set once per round) and the queries whose stopping rule fires are
+    /// retired. The large groups are split between threads. Honours
+    /// max_codes and SearchParametersConann::prefetch_nprobe. Same results
+    /// as the query-major search, see cluster_major_search. Indexes without
+    /// an InvertedListScanner (fast-scan) override it to reject the flag.
+    virtual void search_cluster_major_with_error_quantification(
+        const float *stop_thresholds, idx_t n, const float *x, idx_t k,
+        float *distances, idx_t *labels, const IVFSearchParameters *params,
+        IndexIVFStats *ivf_stats) const;
+
+    /// gt: nq * k ground-truth ids, or nullptr to derive them from the
+    /// nprobe = nlist sweep (sweep_ground_truth) without a separate pass
     CalibrationResults calibrate(float alpha, int k, float calib_sz,
                                  float tune_sz, float *xq, size_t nq,
                                  faiss::idx_t *gt, float max_distance,
                                  std::string dataset_key);
 
+    /** calibrate for several k from a single sweep with max(ks).
+     *
+     * The scores and predictions of each smaller k are derived from the
+     * sweep (restrict_scores). gt has max(ks) ids per query, sorted by
+     * distance (or nullptr, see sweep_ground_truth). Returns the results in
+     * the order of ks; the index is left calibrated for max(ks).
+     */
+    std::vector<CalibrationResults> calibrate(
+        float alpha, const std::vector<int> &ks, float calib_sz, float tune_sz,
+        float *xq, size_t nq, faiss::idx_t *gt, float max_distance,
+        std::string dataset_key);
+
+    /** calibrate for a grid of alphas in one pass.
+     *
+     * The FNR step functions do not depend on alpha: each lambda_reg
+     * candidate is evaluated for all the alphas on the same curve, and the
+     * lamhat of every alpha is read off the calib curve of its lambda_reg.
+     * Returns the results in the order of alphas (see search_conann with
+     * per-query alphas); the index is left calibrated for alphas.back().
+     */
+    std::vector<CalibrationResults> calibrate_alpha_grid(
+        const std::vector<float> &alphas, int k, float calib_sz,
+        float tune_sz, float *xq, size_t nq, faiss::idx_t *gt,
+        float max_distance, std::string dataset_key);
+
+    /// calibrate on the splits computed by prep_execution
+    CalibrationResults calibrate_prepared(float alpha);
+
+    std::vector<CalibrationResults> calibrate_prepared(
+        const std::vector<float> &alphas);
+
+    /// nprobe_budget and nprobe_prefetch of results, from the nb of
+    /// clusters probed on the calib and tune splits
+    void set_probe_budgets(CalibrationResults &results) const;
+
+    /// nprobe_budget (max) and nprobe_prefetch (prefetch_quantile) of
+    /// results, from the nb of clusters probed by each calibration query
+    /// (compute_probe_count, any order)
+    void set_probe_budgets(CalibrationResults &results,
+                           std::vector<int> counts) const;
+
     float optimization(
         float alpha, int kreg, float lambda_reg,
         const std::vector<std::vector<float>> &calib_cx,
         const std::vector<std::vector<faiss::idx_t>> &calib_labels,
         const std::vector<std::vector<float>> &calib_nonconf,
-        const std::vector<std::vector<std::vector<faiss::idx_t>>> &calib_preds);
+        const ConannPredictionsView &calib_preds,
+        const std::vector<std::vector<int>> *sorted_indices = nullptr);
+
+    float optimization(
+        float alpha, int kreg, float lambda_reg,
+        const std::vector<std::vector<float>> &calib_nonconf,
+        const GtHits &calib_hits,
+        const std::vector<std::vector<int>> *sorted_indices = nullptr);
 
     double false_negative_rate(
         const std::vector<std::vector<faiss::idx_t>> &prediction_set,
@@ -499,7 +760,7 @@ struct IndexIVF : Index, IndexIVFInterface {
         const std::vector<std::vector<float>> &calib_cx,
         const std::vector<std::vector<faiss::idx_t>> &calib_labels,
         const std::vector<std::vector<float>> &calib_nonconf,
-        const std::vector<std::vector<std::vector<faiss::idx_t>>> &calib_preds);
+        const ConannPredictionsView &calib_preds);
 
     std::pair<std::vector<float>, std::vector<int>>
     evaluate_test(CalibrationResults params);
@@ -509,11 +770,84 @@ struct IndexIVF : Index, IndexIVFInterface {
         const std::vector<std::vector<float>> &queries,
         const std::vector<std::vector<faiss::idx_t>> &labels,
         const std::vector<std::vector<float>> &nonconf_scores,
-        const std::vector<std::vector<std::vector<faiss::idx_t>>> &all_preds);
+        const ConannPredictionsView &all_preds,
+        const std::vector<std::vector<int>> *sorted_indices = nullptr);
 
     void search_conann(idx_t n, const float *x, float *distances, idx_t *labels,
                        CalibrationResults calib_params);
 
+    /// search_conann with the stored calibration (requires is_calibrated)
+    void search_conann(idx_t n, const float *x, float *distances,
+                       idx_t *labels);
+
+    /** search_conann with a k per query, in one batch.
+     *
+     * Query i returns ks[i] results, with the calibration table[j] where
+     * table_ks[j] == ks[i] (eg. from calibrate(alpha, table_ks, ...)). The
+     * output is ragged: the results of query i are at
+     * [result->lims[i], result->lims[i + 1]), padded with -1 as usual.
+     */
+    void search_conann(idx_t n, const float *x, const idx_t *ks,
+                       const std::vector<int> &table_ks,
+                       const std::vector<CalibrationResults> &table,
+                       RangeSearchResult *result) const;
+
+    /** search_conann with an alpha (FNR budget) per query, in one batch.
+     *
+     * Query i uses the calibration of the largest table_alphas[j] <=
+     * alphas[i] (eg. from calibrate_alpha_grid), or no early stopping if
+     * alphas[i] is below the whole table. Output is n * K as usual.
+     */
+    void search_conann(idx_t n, const float *x, const float *alphas,
+                       const std::vector<float> &table_alphas,
+                       const std::vector<CalibrationResults> &table,
+                       float *distances, idx_t *labels) const;
+
+    /// runs query i with table[entry[i]] and k = entry_k[entry[i]], in
+    /// chunks of queries with the same entry. store(i, dis, labels) is
+    /// called from the worker threads.
+    void search_conann_grouped(
+        idx_t n, const float *x, const int *entry,
+        const std::vector<int> &entry_k,
+        const std::vector<CalibrationResults> &table,
+        const std::function<void(idx_t, const float *, const idx_t *)> &store)
+        const;
+
+    /** Online stopping rule compiled into k-th distance thresholds.
+     *
+     * The search stops after probe rank ik (and returns the results of rank
+     * ik - 1) iff the k-th distance is <= table[ik]. This is the same
+     * decision as comparing the regularized score to lamhat, since the score
+     * does not increase with the distance. The table has nlist entries.
+     */
+    std::vector<float> compile_stop_thresholds(
+        const CalibrationResults &calib_params) const;
+
+    /// nb of clusters that search_conann probes for one query
+    /// (nonconformity scores in probe order)
+    int compute_probe_count(const CalibrationResults &calib_params,
+                            const std::vector<float> &nonconf) const;
+
+    /// compute_probe_count of each of the given queries
+    std::vector<int> compute_probe_counts(
+        const CalibrationResults &calib_params,
+        const std::vector<std::vector<float>> &nonconf) const;
+
+    /// max nb of clusters that search_conann probes for the given queries,
+    /// at least 1
+    int compute_nprobe_budget(
+        const CalibrationResults &calib_params,
+        const std::vector<std::vector<float>> &nonconf) const;
+
+    /// search parameters of search_conann for calib_params (nprobe is the
+    /// probe budget, max_codes is the one of the index)
+    SearchParametersConann conann_search_params(
+        const CalibrationResults &calib_params) const;
+
+    /// table for calib_params, compiled on the first call with new params
+    const std::vector<float> &get_stop_thresholds(
+        const CalibrationResults &calib_params);
+
     // --- RAPS
     std::vector<std::pair<int, float>> sort_classes_by_probability(
         const std::vector<float> &class_probabilities) const;
@@ -523,9 +857,14 @@ struct IndexIVF : Index, IndexIVFInterface {
 
     float compute_regularization(int ox_y, float lambda, int kreg) const;
 
+    /// rank permutation of the scores of each query (descending, ties broken
+    /// by index). Does not depend on lambda, so it can be computed once and
+    /// passed to optimization / evaluate for several lambda_reg values.
     std::vector<std::vector<int>> compute_sorted_indices(
         const std::vector<std::vector<float>> &class_probabilities) const;
 
+    /// regularized scores, using the rank permutation I from
+    /// compute_sorted_indices
     std::vector<std::vector<float>>
     regularize_scores(const std::vector<std::vector<float>> &s, // scores
                       const std::vector<std::vector<int>> &I, float lambda,
@@ -535,6 +874,10 @@ struct IndexIVF : Index, IndexIVFInterface {
                   float alpha) const;
 
     float pick_lambda_reg(float alpha, int kreg) const;
+
+    /// one lambda_reg per alpha, evaluated on shared FNR curves
+    std::vector<float> pick_lambda_reg(const std::vector<float> &alphas,
+                                       int kreg) const;
 };
 
 struct RangeQueryResult;
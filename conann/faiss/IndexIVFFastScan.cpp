@@ -10,6 +10,8 @@
 #include <cassert>
 #include <cinttypes>
 #include <cstdio>
+#include <limits>
+#include <mutex>
 #include <set>
 
 #include <omp.h>
@@ -1335,6 +1337,395 @@ void IndexIVFFastScan::search_implem_14(
     indexIVF_stats.nlist += nlist_visited;
 }
 
+template <class C>
+void IndexIVFFastScan::search_implem_conann(
+        const float* stop_thresholds,
+        idx_t n,
+        const float* x,
+        idx_t k,
+        float* distances,
+        idx_t* labels,
+        std::vector<float>* nonconf_list,
+        std::vector<ConannTopkEntry>* all_preds_list,
+        const CoarseQuantized& cq,
+        const IVFSearchParameters* params,
+        size_t* ndis_out,
+        size_t* nlist_out,
+        std::vector<idx_t>* exhausted) const {
+    using T = typename C::T;
+    size_t dim12 = ksub * M2;
+    AlignedTable<uint8_t> dis_tables;
+    AlignedTable<uint16_t> biases;
+    std::unique_ptr<float[]> normalizers(new float[2 * n]);
+
+    compute_LUT_uint8(n, x, cq, dis_tables, biases, normalizers.get());
+
+    bool single_LUT = !lookup_table_is_3d();
+    const float* norms = skip & 16 ? nullptr : normalizers.get();
+
+    HeapHandler<C, true> handler(
+            n, 0, k, distances, labels, params ? params->sel : nullptr);
+    int qmap1[1];
+    handler.q_map = qmap1;
+    handler.begin(norms);
+
+    const bool early_stop = all_preds_list == nullptr && stop_thresholds;
+    // with L2 the k-th distance is the root of the max-heap
+    const bool kth_is_root = C::is_max;
+    size_t nprobe = cq.nprobe;
+    size_t ndis = 0, nlist_visited = 0;
+    size_t max_codes = params ? params->max_codes : this->max_codes;
+    if (max_codes == 0) {
+        max_codes = std::numeric_limits<size_t>::max();
+    }
+    // the first window of lists is prefetched by the caller, the next one
+    // when the query is half way through it
+    auto cparams = dynamic_cast<const SearchParametersConann*>(params);
+    const size_t prefetch_window =
+            early_stop && cparams && cparams->prefetch_nprobe > 0
+            ? std::min(nprobe, cparams->prefetch_nprobe)
+            : nprobe;
+
+    // heap of the query before the current list, and in float
+    ConannTopkSnapshot<T, int64_t> prev(early_stop ? k : 0);
+    std::vector<float> simi(k);
+    ConannTopkRecorder topk_recorder;
+
+    for (idx_t i = 0; i < n; i++) {
+        const uint8_t* LUT = nullptr;
+        qmap1[0] = i;
+        T* heap_dis = handler.idis.data() + i * k;
+        int64_t* heap_ids = handler.iids.data() + i * k;
+
+        float one_a = 1, b = 0;
+        if (norms) {
+            one_a = 1 / norms[2 * i];
+            b = norms[2 * i + 1];
+        }
+        // same k-th score as IndexIVF, on the float conversion of the heap
+        auto kth_score = [&]() {
+            if (kth_is_root) {
+                return heap_ids[0] < 0 ? std::numeric_limits<float>::max()
+                                       : heap_dis[0] * one_a + b;
+            }
+            float best = -std::numeric_limits<float>::max();
+            for (idx_t j = 0; j < k; j++) {
+                if (heap_ids[j] >= 0) {
+                    best = std::max(best, heap_dis[j] * one_a + b);
+                }
+            }
+            return best;
+        };
+
+        if (single_LUT) {
+            LUT = dis_tables.get() + i * dim12;
+        }
+        if (all_preds_list != nullptr) {
+            all_preds_list[i].clear();
+            topk_recorder.clear();
+        }
+        prev.reset();
+        size_t nscan = 0;
+        size_t prefetched = prefetch_window;
+        bool stopped = false;
+
+        for (idx_t ik = 0; ik < nprobe; ik++) {
+            if (prefetched < nprobe && ik + prefetch_window / 2 >= prefetched) {
+                size_t n_next = std::min(prefetch_window, nprobe - prefetched);
+                invlists->prefetch_lists(cq.ids + i * nprobe + prefetched, n_next);
+                prefetched += n_next;
+            }
+            if (early_stop) {
+                // the k-th distance can only decrease, so this probe would
+                // be rolled back anyway: stop before scanning it
+                if (kth_is_root && kth_score() <= stop_thresholds[ik]) {
+                    stopped = true;
+                    break;
+                }
+                prev.save(k, heap_dis, heap_ids);
+            }
+
+            size_t ij = i * nprobe + ik;
+            if (!single_LUT) {
+                LUT = dis_tables.get() + ij * dim12;
+            }
+            if (biases.get()) {
+                handler.dbias = biases.get() + ij;
+            }
+
+            idx_t list_no = cq.ids[ij];
+            size_t ls = list_no >= 0 ? invlists->list_size(list_no) : 0;
+            // the codes past the budget are masked out by the handler
+            ls = std::min(ls, max_codes - nscan);
+            size_t nup0 = handler.nup;
+            if (ls > 0) {
+                InvertedLists::ScopedCodes codes(invlists, list_no);
+                InvertedLists::ScopedIds ids(invlists, list_no);
+
+                handler.ntotal = ls;
+                handler.id_map = ids.get();
+
+                pq4_accumulate_loop(
+                        1,
+                        roundup(ls, bbs),
+                        bbs,
+                        M2,
+                        codes.get(),
+                        LUT,
+                        handler,
+                        nullptr);
+                nlist_visited++;
+                ndis += ls;
+            }
+            nscan += ls;
+
+            bool heap_changed = handler.nup != nup0;
+            float score_k = kth_score();
+
+            if (all_preds_list == nullptr) {
+                if (nscan >= max_codes) {
+                    // out of codes: the last list is kept
+                    stopped = true;
+                    break;
+                }
+                if (!early_stop) {
+                    continue;
+                }
+                if (score_k <= stop_thresholds[ik]) {
+                    // one list too many: back to the previous results
+                    prev.restore(k, heap_changed, heap_dis, heap_ids);
+                    stopped = true;
+                    break;
+                }
+                prev.update(heap_changed);
+            } else {
+                if (heap_changed) {
+                    for (idx_t j = 0; j < k; j++) {
+                        simi[j] = heap_dis[j] * one_a + b;
+                    }
+                    topk_recorder.record(
+                            ik,
+                            k,
+                            simi.data(),
+                            heap_ids,
+                            nlist,
+                            all_preds_list[i]);
+                }
+                nonconf_list[i][ik] = score_k > MAX_DISTANCE
+                        ? 1.0
+                        : score_k / MAX_DISTANCE;
+                if (nscan >= max_codes) {
+                    // the search stops after this list: the later ranks keep
+                    // its top-k and its score
+                    std::fill(
+                            nonconf_list[i].begin() + ik + 1,
+                            nonconf_list[i].end(),
+                            nonconf_list[i][ik]);
+                    break;
+                }
+            }
+        }
+        if (exhausted && early_stop && !stopped) {
+            exhausted->push_back(i);
+        }
+    }
+
+    // reorders the heaps and converts them to float
+    handler.end();
+    *ndis_out = ndis;
+    *nlist_out = nlist_visited;
+}
+
+void IndexIVFFastScan::search_cluster_major_with_error_quantification(
+        const float*,
+        idx_t,
+        const float*,
+        idx_t,
+        float*,
+        idx_t*,
+        const IVFSearchParameters*,
+        IndexIVFStats*) const {
+    FAISS_THROW_MSG(
+            "cluster_major_search not supported by IndexIVFFastScan");
+}
+
+void IndexIVFFastScan::search_slice_with_error_quantification(
+        const float* stop_thresholds,
+        idx_t n,
+        const float* x,
+        idx_t k,
+        float* distances,
+        idx_t* labels,
+        std::vector<float>* nonconf_list,
+        std::vector<ConannTopkEntry>* all_preds_list,
+        const IVFSearchParameters* params,
+        IndexIVFStats* ivf_stats) const {
+    size_t nprobe = std::min(nlist, params ? params->nprobe : this->nprobe);
+    FAISS_THROW_IF_NOT_MSG(
+            !refine_index, "refine_index not supported for this index");
+    int pmode = parallel_mode & ~PARALLEL_MODE_NO_HEAP_INIT;
+    FAISS_THROW_IF_NOT_MSG(
+            pmode == 0 || pmode == 3,
+            "IndexIVFFastScan supports parallel_mode 0 or 3 with ConANN");
+    if (n == 0) {
+        return;
+    }
+
+    // the 3D look-up tables of a batch must fit in the same budget as for
+    // search (see compute_search_nslice)
+    idx_t bs = n;
+    if (lookup_table_is_3d()) {
+        size_t lut_size_per_query =
+                M * ksub * nprobe * (sizeof(float) + sizeof(uint8_t));
+        bs = std::max(precomputed_table_max_bytes / lut_size_per_query,
+                      size_t(1));
+    }
+    // parallel_mode 3: the batches of queries are spread over the threads
+    int nt = pmode == 3 ? std::min(omp_get_max_threads(), int(n)) : 1;
+    bs = std::min(bs, (n + nt - 1) / nt);
+    idx_t nbatch = (n + bs - 1) / bs;
+
+    // early stopping: only the first lists of each query are prefetched, the
+    // probe loop prefetches the next ones
+    auto cparams = dynamic_cast<const SearchParametersConann*>(params);
+    size_t window = cparams && stop_thresholds && !all_preds_list
+            ? std::min(nprobe, cparams->prefetch_nprobe)
+            : 0;
+
+    // the queries that spend the budget without stopping are searched again
+    // on all the lists, which keeps the guarantee of the stopping rule
+    const bool extend = stop_thresholds && !all_preds_list && cparams &&
+            cparams->extend_budget && nprobe < nlist;
+    idx_t bs_ext = 1;
+    if (extend && lookup_table_is_3d()) {
+        size_t lut_size_per_query =
+                M * ksub * nlist * (sizeof(float) + sizeof(uint8_t));
+        bs_ext = std::max(precomputed_table_max_bytes / lut_size_per_query,
+                          size_t(1));
+    }
+
+    size_t ndis = 0, nlist_visited = 0;
+    double t_quantize = 0, t0 = getmillisecs();
+    std::mutex exception_mutex;
+    std::string exception_string;
+
+#pragma omp parallel for if (nt > 1) schedule(dynamic) \
+        reduction(+ : ndis, nlist_visited, t_quantize)
+    for (idx_t batch = 0; batch < nbatch; batch++) {
+        idx_t i0 = batch * bs;
+        idx_t i1 = std::min(n, i0 + bs);
+        // accumulates into the reduction variables of the thread
+        auto search_batch = [&](idx_t nb,
+                                const float* xb,
+                                float* db,
+                                idx_t* lb,
+                                size_t nprobe_b,
+                                size_t window_b,
+                                std::vector<float>* nonconf_b,
+                                std::vector<ConannTopkEntry>* all_preds_b,
+                                std::vector<idx_t>* exhausted) {
+            double t1 = getmillisecs();
+            CoarseQuantizedWithBuffer cq(
+                    CoarseQuantized{nprobe_b, nullptr, nullptr});
+            cq.quantize(
+                    quantizer,
+                    nb,
+                    xb,
+                    params ? params->quantizer_params : nullptr);
+            if (window_b > 0 && window_b < nprobe_b) {
+                std::vector<idx_t> first_lists(nb * window_b);
+                for (idx_t i = 0; i < nb; i++) {
+                    std::copy(cq.ids + i * nprobe_b,
+                              cq.ids + i * nprobe_b + window_b,
+                              first_lists.begin() + i * window_b);
+                }
+                invlists->prefetch_lists(
+                        first_lists.data(), first_lists.size());
+            } else {
+                invlists->prefetch_lists(cq.ids, nb * nprobe_b);
+            }
+            t_quantize += getmillisecs() - t1;
+
+            size_t ndis_i = 0, nlist_i = 0;
+            // clang-format off
+            if (is_similarity_metric(metric_type)) {
+                search_implem_conann<CMin<uint16_t, int64_t>>(
+                        stop_thresholds, nb, xb, k, db, lb, nonconf_b,
+                        all_preds_b, cq, params, &ndis_i, &nlist_i, exhausted);
+            } else {
+                search_implem_conann<CMax<uint16_t, int64_t>>(
+                        stop_thresholds, nb, xb, k, db, lb, nonconf_b,
+                        all_preds_b, cq, params, &ndis_i, &nlist_i, exhausted);
+            }
+            // clang-format on
+            ndis += ndis_i;
+            nlist_visited += nlist_i;
+        };
+
+        try {
+            std::vector<idx_t> exhausted;
+            search_batch(
+                    i1 - i0,
+                    x + i0 * d,
+                    distances + i0 * k,
+                    labels + i0 * k,
+                    nprobe,
+                    window,
+                    nonconf_list ? nonconf_list + i0 : nullptr,
+                    all_preds_list ? all_preds_list + i0 : nullptr,
+                    extend ? &exhausted : nullptr);
+
+            // the first nprobe lists are scanned again: the rerun is only
+            // for the tail of the queries the calibration did not cover
+            std::vector<float> xe, de;
+            std::vector<idx_t> le;
+            for (size_t e0 = 0; e0 < exhausted.size(); e0 += bs_ext) {
+                size_t ne = std::min(exhausted.size() - e0, size_t(bs_ext));
+                xe.resize(ne * d);
+                de.resize(ne * k);
+                le.resize(ne * k);
+                for (size_t j = 0; j < ne; j++) {
+                    std::copy(x + (i0 + exhausted[e0 + j]) * d,
+                              x + (i0 + exhausted[e0 + j] + 1) * d,
+                              xe.begin() + j * d);
+                }
+                search_batch(
+                        ne,
+                        xe.data(),
+                        de.data(),
+                        le.data(),
+                        nlist,
+                        window,
+                        nullptr,
+                        nullptr,
+                        nullptr);
+                for (size_t j = 0; j < ne; j++) {
+                    idx_t i = i0 + exhausted[e0 + j];
+                    std::copy(de.begin() + j * k,
+                              de.begin() + (j + 1) * k,
+                              distances + i * k);
+                    std::copy(le.begin() + j * k,
+                              le.begin() + (j + 1) * k,
+                              labels + i * k);
+                }
+            }
+        } catch (const std::exception& e) {
+            std::lock_guard<std::mutex> lock(exception_mutex);
+            exception_string = e.what();
+        }
+    }
+    if (!exception_string.empty()) {
+        FAISS_THROW_FMT(
+                "search interrupted with: %s", exception_string.c_str());
+    }
+
+    ivf_stats->nq += n;
+    ivf_stats->ndis += ndis;
+    ivf_stats->nlist += nlist_visited;
+    ivf_stats->quantization_time += t_quantize;
+    ivf_stats->search_time += getmillisecs() - t0;
+}
+
 void IndexIVFFastScan::reconstruct_from_offset(
         int64_t list_no,
         int64_t offset,
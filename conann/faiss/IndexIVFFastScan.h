@@ -217,6 +217,58 @@ struct IndexIVFFastScan : IndexIVF {
             const NormTableScaler* scaler,
             const IVFSearchParameters* params = nullptr) const;
 
+    /** ConANN probe loop of IndexIVF::search_with_error_quantification on
+     * the fast-scan kernels. Queries are scanned one at a time as in implem
+     * 10, and the stopping rule (or the calibration scores) is applied on
+     * the int16 heap of the query after each inverted list. Distances are
+     * the fast-scan estimates, for calibration and search alike. Like
+     * IndexIVF, the heap is only copied when the previous list changed it,
+     * and max_codes and SearchParametersConann::prefetch_nprobe are
+     * honoured. parallel_mode 3 spreads the batches of queries over the
+     * threads; the intra-query modes 1 and 2 are not supported. With
+     * SearchParametersConann::extend_budget, the queries that spend the
+     * nprobe budget without stopping are searched again on all the lists.
+     */
+    void search_slice_with_error_quantification(
+            const float* stop_thresholds,
+            idx_t n,
+            const float* x,
+            idx_t k,
+            float* distances,
+            idx_t* labels,
+            std::vector<float>* nonconf_list,
+            std::vector<ConannTopkEntry>* all_preds_list,
+            const IVFSearchParameters* params,
+            IndexIVFStats* ivf_stats) const override;
+
+    /// not supported: the fast-scan kernels have no InvertedListScanner to
+    /// scan a list for a group of queries, throws
+    void search_cluster_major_with_error_quantification(
+            const float* stop_thresholds,
+            idx_t n,
+            const float* x,
+            idx_t k,
+            float* distances,
+            idx_t* labels,
+            const IVFSearchParameters* params,
+            IndexIVFStats* ivf_stats) const override;
+
+    template <class C>
+    void search_implem_conann(
+            const float* stop_thresholds,
+            idx_t n,
+            const float* x,
+            idx_t k,
+            float* distances,
+            idx_t* labels,
+            std::vector<float>* nonconf_list,
+            std::vector<ConannTopkEntry>* all_preds_list,
+            const CoarseQuantized& cq,
+            const IVFSearchParameters* params,
+            size_t* ndis_out,
+            size_t* nlist_out,
+            std::vector<idx_t>* exhausted = nullptr) const;
+
     // reconstruct vectors from packed invlists
     void reconstruct_from_offset(int64_t list_no, int64_t offset, float* recons)
             const override;
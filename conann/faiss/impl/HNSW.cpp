@@ -585,7 +585,8 @@ int search_from_candidates(
         HNSWStats& stats,
         int level,
         int nres_in,
-        const SearchParametersHNSW* params) {
+        const SearchParametersHNSW* params,
+        HNSWStepObserver* observer) {
     int nres = nres_in;
     int ndis = 0;
 
@@ -613,6 +614,12 @@ int search_from_candidates(
     int nstep = 0;
 
     while (candidates.size() > 0) {
+        if (observer && nstep % observer->step_size == 0 &&
+            observer->before_step(nstep / observer->step_size,
+                                  res.threshold)) {
+            break;
+        }
+
         float d0 = 0;
         int v0 = candidates.pop_min(&d0);
 
@@ -255,6 +255,19 @@ struct HNSWStats {
 // global var that collects them all
 FAISS_API extern HNSWStats hnsw_stats;
 
+/** Hook on the progress of the level-0 search of one query, used for
+ * per-query early termination (see ConannHNSW). */
+struct HNSWStepObserver {
+    /// nb of node expansions per step
+    int step_size = 1;
+
+    /** called before step `step` with the current threshold of the result
+     * handler (the k-th distance), returns whether to stop the search */
+    virtual bool before_step(int step, float threshold) = 0;
+
+    virtual ~HNSWStepObserver() {}
+};
+
 int search_from_candidates(
         const HNSW& hnsw,
         DistanceComputer& qdis,
@@ -264,7 +277,8 @@ int search_from_candidates(
         HNSWStats& stats,
         int level,
         int nres_in = 0,
-        const SearchParametersHNSW* params = nullptr);
+        const SearchParametersHNSW* params = nullptr,
+        HNSWStepObserver* observer = nullptr);
 
 HNSWStats greedy_update_nearest(
         const HNSW& hnsw,
@@ -465,6 +465,7 @@ void read_ivf_header(
     read_index_header(ivf, f);
     READ1(ivf->nlist);
     READ1(ivf->nprobe);
+    ivf->n_list = ivf->nlist;
     ivf->quantizer = read_index(f);
     ivf->own_fields = true;
     if (ids) { // used in legacy "Iv" formats
@@ -893,6 +894,35 @@ Index* read_index(IOReader* f, int io_flags) {
             READ1(index_ivfpq->use_precomputed_table);
         }
         idx = indep;
+    } else if (h == fourcc("CnAN")) {
+        // ConANN calibration, followed by the IVF index it applies to
+        int K;
+        float max_distance;
+        IndexIVF::CalibrationResults calibration;
+        std::vector<float> thresholds;
+        READ1(K);
+        READ1(max_distance);
+        READ1(calibration.lamhat);
+        READ1(calibration.kreg);
+        READ1(calibration.regLambda);
+        READ1(calibration.nprobe_budget);
+        READ1(calibration.nprobe_prefetch);
+        READVECTOR(thresholds);
+        idx = read_index(f, io_flags);
+        IndexIVF* ivf = dynamic_cast<IndexIVF*>(idx);
+        if (!ivf) {
+            delete idx;
+            FAISS_THROW_MSG("ConANN calibration must precede an IVF index");
+        }
+        ivf->K = K;
+        ivf->MAX_DISTANCE = max_distance;
+        ivf->calibration = calibration;
+        ivf->is_calibrated = true;
+        if (thresholds.size() == ivf->nlist) {
+            ivf->stop_thresholds = std::move(thresholds);
+            ivf->stop_thresholds_params = calibration;
+            ivf->stop_thresholds_max_distance = max_distance;
+        }
     } else if (h == fourcc("IxPT")) {
         IndexPreTransform* ixpt = new IndexPreTransform();
         ixpt->own_fields = true;
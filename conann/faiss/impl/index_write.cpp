@@ -392,7 +392,43 @@ static void write_ivf_header(const IndexIVF* ivf, IOWriter* f) {
     write_direct_map(&ivf->direct_map, f);
 }
 
+// ConANN calibration of an IVF index, written before the index itself with
+// IO_FLAG_CONANN_CALIBRATION
+static void write_conann_state(const IndexIVF* ivf, IOWriter* f) {
+    uint32_t h = fourcc("CnAN");
+    WRITE1(h);
+    WRITE1(ivf->K);
+    WRITE1(ivf->MAX_DISTANCE);
+    WRITE1(ivf->calibration.lamhat);
+    WRITE1(ivf->calibration.kreg);
+    WRITE1(ivf->calibration.regLambda);
+    WRITE1(ivf->calibration.nprobe_budget);
+    WRITE1(ivf->calibration.nprobe_prefetch);
+    // the compiled stopping thresholds, if they match the calibration
+    const IndexIVF::CalibrationResults& tp = ivf->stop_thresholds_params;
+    bool has_thresholds = ivf->stop_thresholds.size() == ivf->nlist &&
+            ivf->stop_thresholds_max_distance == ivf->MAX_DISTANCE &&
+            tp.lamhat == ivf->calibration.lamhat &&
+            tp.kreg == ivf->calibration.kreg &&
+            tp.regLambda == ivf->calibration.regLambda;
+    std::vector<float> thresholds;
+    if (has_thresholds) {
+        thresholds = ivf->stop_thresholds;
+    }
+    WRITEVECTOR(thresholds);
+}
+
 void write_index(const Index* idx, IOWriter* f, int io_flags) {
+    if (io_flags & IO_FLAG_CONANN_CALIBRATION) {
+        const IndexIVF* ivf = dynamic_cast<const IndexIVF*>(idx);
+        FAISS_THROW_IF_NOT_MSG(
+                ivf, "IO_FLAG_CONANN_CALIBRATION needs an IndexIVF");
+        if (ivf->is_calibrated) {
+            write_conann_state(ivf, f);
+        }
+        // the sub-indexes are written in the stock format
+        io_flags &= ~IO_FLAG_CONANN_CALIBRATION;
+    }
     if (idx == nullptr) {
         // eg. for a storage component of HNSW that is set to nullptr
         uint32_t h = fourcc("null");
@@ -320,6 +320,7 @@ struct HeapHandler : ResultHandlerCompare<C, with_id_map> {
     int64_t* ids;
 
     int64_t k; // number of results to keep
+    size_t nup = 0; // number of heap updates so far
 
     HeapHandler(
             size_t nq,
@@ -372,6 +373,7 @@ struct HeapHandler : ResultHandlerCompare<C, with_id_map> {
                     if (C::cmp(heap_dis[0], dis)) {
                         heap_replace_top<C>(
                                 k, heap_dis, heap_ids, dis, real_idx);
+                        nup++;
                     }
                 }
             }
@@ -384,6 +386,7 @@ struct HeapHandler : ResultHandlerCompare<C, with_id_map> {
                 if (C::cmp(heap_dis[0], dis)) {
                     int64_t idx = this->adjust_id(b, j);
                     heap_replace_top<C>(k, heap_dis, heap_ids, dis, idx);
+                    nup++;
                 }
             }
         }
@@ -35,6 +35,11 @@ struct InvertedLists;
 
 /// skip the storage for graph-based indexes
 const int IO_FLAG_SKIP_STORAGE = 1;
+/// write the ConANN calibration of a calibrated IndexIVF: a "CnAN" block
+/// (K, MAX_DISTANCE, calibration, stopping thresholds) in front of the
+/// index. Applies to the top-level index only; stock faiss readers cannot
+/// read such a file, read_index can with or without the block.
+const int IO_FLAG_CONANN_CALIBRATION = 64;
 
 void write_index(const Index* idx, const char* fname, int io_flags = 0);
 void write_index(const Index* idx, FILE* f, int io_flags = 0);
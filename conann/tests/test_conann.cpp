@@ -0,0 +1,1523 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <faiss/ConannCacheFile.h>
+#include <faiss/ConannHNSW.h>
+#include <faiss/ConannOnlineCalibrator.h>
+#include <faiss/IndexFlat.h>
+#include <faiss/IndexHNSW.h>
+#include <faiss/IndexPreTransform.h>
+#include <faiss/IndexIVFFlat.h>
+#include <faiss/IndexIVFPQ.h>
+#include <faiss/IndexIVFPQFastScan.h>
+#include <faiss/impl/AuxIndexStructures.h>
+#include <faiss/impl/io.h>
+#include <faiss/index_io.h>
+#include <faiss/invlists/InvertedLists.h>
+#include <faiss/utils/distances.h>
+
+namespace {
+
+typedef faiss::idx_t idx_t;
+
+const int d = 16;
+const size_t nb = 5000;
+const size_t nq = 50;
+const size_t nlist = 32;
+const int k = 10;
+
+std::vector<float> make_data(size_t n, int seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> normal;
+    std::vector<float> x(n * d);
+    for (auto& v : x) {
+        v = normal(rng);
+    }
+    return x;
+}
+
+} // namespace
+
+// the top-k changelog collected during calibration must match a regular
+// IVF search with nprobe = step + 1
+TEST(CONANN, preds_changelog_matches_search) {
+    std::vector<float> xb = make_data(nb, 123);
+    std::vector<float> xq = make_data(nq, 456);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+    index.nprobe = nlist;
+    index.K = k;
+
+    auto [nonconf, preds] = index.compute_scores(
+            faiss::IndexIVF::CalibrationResults{10, 0, 0}, nq, xq.data());
+    faiss::ConannPredictionsView view = preds.view();
+    ASSERT_EQ(view.size(), nq);
+    // much smaller than the nq * nlist * k dense layout
+    EXPECT_LT(preds.entries.size(), nq * nlist * k);
+
+    std::vector<idx_t> I(nq * k), rec(k);
+    std::vector<float> D(nq * k);
+    for (size_t step : {0, 1, 4, 15, 31}) {
+        index.nprobe = step + 1;
+        index.search(nq, xq.data(), k, D.data(), I.data());
+        for (size_t q = 0; q < nq; q++) {
+            std::set<idx_t> ref;
+            for (int j = 0; j < k; j++) {
+                if (I[q * k + j] >= 0) {
+                    ref.insert(I[q * k + j]);
+                }
+            }
+            size_t n = view.reconstruct(q, step, rec.data());
+            std::set<idx_t> got(rec.begin(), rec.begin() + n);
+            EXPECT_EQ(ref, got) << "q=" << q << " step=" << step;
+        }
+    }
+
+    // nonconformity scores are non-increasing along the probe order
+    for (size_t q = 0; q < nq; q++) {
+        for (size_t j = 1; j < nlist; j++) {
+            EXPECT_LE(nonconf[q][j], nonconf[q][j - 1]);
+        }
+    }
+}
+
+// the precomputed FNR step function must agree with the reference
+// compute_predictions + false_negative_rate path for any lambda
+TEST(CONANN, fnr_step_function_matches_predictions) {
+    std::vector<float> xb = make_data(nb, 789);
+    std::vector<float> xq = make_data(nq, 1011);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+    index.nprobe = nlist;
+    index.K = k;
+
+    faiss::IndexFlatL2 exact(d);
+    exact.add(nb, xb.data());
+    std::vector<idx_t> gt(nq * k);
+    std::vector<float> gt_dis(nq * k);
+    exact.search(nq, xq.data(), k, gt_dis.data(), gt.data());
+    std::vector<std::vector<idx_t>> labels(nq);
+    for (size_t q = 0; q < nq; q++) {
+        labels[q].assign(gt.begin() + q * k, gt.begin() + (q + 1) * k);
+    }
+
+    auto [nonconf, preds] = index.compute_scores(
+            faiss::IndexIVF::CalibrationResults{10, 0, 0}, nq, xq.data());
+    auto sorted_indices = index.compute_sorted_indices(nonconf);
+    auto reg_nonconf =
+            index.regularize_scores(nonconf, sorted_indices, 0.01, 1);
+
+    auto fnr_curve =
+            index.compute_fnr_step_function(labels, reg_nonconf, preds.view());
+    for (float lambda = 0; lambda <= 1.0; lambda += 0.01) {
+        auto [pred_sets, cls] =
+                index.compute_predictions(lambda, reg_nonconf, preds.view());
+        EXPECT_EQ(fnr_curve.fnr(lambda),
+                  index.false_negative_rate(pred_sets, labels))
+                << "lambda=" << lambda;
+    }
+
+    // per-query fnr / clusters searched match the reference evaluate()
+    for (float lamhat : {0.0f, 0.3f, 0.6f, 1.0f}) {
+        std::vector<float> fnrs;
+        std::vector<int> cls;
+        fnr_curve.evaluate(lamhat, fnrs, cls);
+        auto [ref_fnrs, ref_cls] = index.evaluate(
+                faiss::IndexIVF::CalibrationResults{lamhat, 1, 0.01f},
+                std::vector<std::vector<float>>(nq),
+                labels,
+                nonconf,
+                preds.view());
+        EXPECT_EQ(fnrs, ref_fnrs) << "lamhat=" << lamhat;
+        EXPECT_EQ(cls, ref_cls) << "lamhat=" << lamhat;
+    }
+
+    // the exact lamhat is admissible and no smaller breakpoint is
+    for (float target : {0.02f, 0.1f, 0.3f}) {
+        float lamhat = fnr_curve.min_admissible_lambda(target);
+        EXPECT_LE(fnr_curve.fnr(lamhat), target);
+        for (float score : fnr_curve.scores) {
+            if (score < lamhat) {
+                EXPECT_GT(fnr_curve.fnr(score), target);
+            }
+        }
+    }
+}
+
+// search_conann stops at the first probe whose regularized score exceeds
+// lamhat and returns the top-k of the previous probe step
+TEST(CONANN, early_stop_matches_calibration_scores) {
+    std::vector<float> xb = make_data(nb, 1213);
+    std::vector<float> xq = make_data(nq, 1415);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+    // calibration and search_conann do not depend on this->nprobe
+    index.K = k;
+
+    auto [nonconf, preds] = index.compute_scores(
+            faiss::IndexIVF::CalibrationResults{10, 0, 0}, nq, xq.data());
+    faiss::ConannPredictionsView view = preds.view();
+    int kreg = 1;
+    float reg_lambda = 0.01;
+    auto sorted_indices = index.compute_sorted_indices(nonconf);
+    auto reg_nonconf =
+            index.regularize_scores(nonconf, sorted_indices, reg_lambda, kreg);
+
+    std::vector<idx_t> I(nq * k), rec(k);
+    std::vector<float> D(nq * k);
+    for (size_t rank : {0, 3, 10, 31}) {
+        faiss::IndexIVF::CalibrationResults params{
+                reg_nonconf[0][rank], kreg, reg_lambda};
+        float lamhat = params.lamhat;
+        // enough probes for all the queries, but fewer than nlist
+        params.nprobe_budget = index.compute_nprobe_budget(params, nonconf);
+        if (rank < 31) {
+            EXPECT_LT(params.nprobe_budget, nlist);
+        }
+        index.search_conann(nq, xq.data(), D.data(), I.data(), params);
+        for (size_t q = 0; q < nq; q++) {
+            size_t stop = 0;
+            while (stop < nlist && reg_nonconf[q][stop] <= lamhat) {
+                stop++;
+            }
+            std::set<idx_t> ref;
+            if (stop > 0) {
+                size_t n = view.reconstruct(q, stop - 1, rec.data());
+                ref.insert(rec.begin(), rec.begin() + n);
+            }
+            std::set<idx_t> got;
+            for (int j = 0; j < k; j++) {
+                if (I[q * k + j] >= 0) {
+                    got.insert(I[q * k + j]);
+                }
+            }
+            EXPECT_EQ(ref, got) << "q=" << q << " lamhat=" << lamhat;
+        }
+    }
+}
+
+// with max_codes the calibration sweep stops where the search runs out of
+// codes, so the early-stop results still match the calibration scores
+TEST(CONANN, max_codes_early_stop_matches_calibration_scores) {
+    std::vector<float> xb = make_data(nb, 1617);
+    std::vector<float> xq = make_data(nq, 1819);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+    index.K = k;
+    index.max_codes = 4 * nb / nlist;
+
+    auto [nonconf, preds] = index.compute_scores(
+            faiss::IndexIVF::CalibrationResults{10, 0, 0}, nq, xq.data());
+    faiss::ConannPredictionsView view = preds.view();
+
+    // the last step of the sweep is the search truncated to max_codes
+    std::vector<idx_t> I(nq * k), rec(k);
+    std::vector<float> D(nq * k);
+    faiss::IVFSearchParameters all;
+    all.nprobe = nlist;
+    all.max_codes = index.max_codes;
+    index.search(nq, xq.data(), k, D.data(), I.data(), &all);
+    for (size_t q = 0; q < nq; q++) {
+        size_t n = view.reconstruct(q, nlist - 1, rec.data());
+        EXPECT_EQ(std::set<idx_t>(rec.begin(), rec.begin() + n),
+                  std::set<idx_t>(I.begin() + q * k, I.begin() + (q + 1) * k))
+                << "q=" << q;
+    }
+
+    int kreg = 1;
+    float reg_lambda = 0.01;
+    auto sorted_indices = index.compute_sorted_indices(nonconf);
+    auto reg_nonconf =
+            index.regularize_scores(nonconf, sorted_indices, reg_lambda, kreg);
+    for (size_t rank : {0, 2, 5, 10, 31}) {
+        faiss::IndexIVF::CalibrationResults params{
+                reg_nonconf[0][rank], kreg, reg_lambda};
+        float lamhat = params.lamhat;
+        params.nprobe_budget = index.compute_nprobe_budget(params, nonconf);
+        index.search_conann(nq, xq.data(), D.data(), I.data(), params);
+        for (size_t q = 0; q < nq; q++) {
+            size_t stop = 0;
+            while (stop < nlist && reg_nonconf[q][stop] <= lamhat) {
+                stop++;
+            }
+            std::set<idx_t> ref;
+            if (stop > 0) {
+                size_t n = view.reconstruct(q, stop - 1, rec.data());
+                ref.insert(rec.begin(), rec.begin() + n);
+            }
+            std::set<idx_t> got;
+            for (int j = 0; j < k; j++) {
+                if (I[q * k + j] >= 0) {
+                    got.insert(I[q * k + j]);
+                }
+            }
+            EXPECT_EQ(ref, got) << "q=" << q << " lamhat=" << lamhat;
+        }
+    }
+}
+
+// the compiled distance thresholds take the same decisions as the
+// regularized score compared to lamhat
+TEST(CONANN, stop_thresholds_match_scores) {
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.MAX_DISTANCE = 50;
+
+    std::mt19937 rng(1617);
+    std::uniform_real_distribution<float> uniform(0, 60);
+    for (float lamhat : {0.01f, 0.08f, 0.0855f, 0.2f}) {
+        faiss::IndexIVF::CalibrationResults params{lamhat, 1, 0.01f};
+        auto thresholds = index.compile_stop_thresholds(params);
+        ASSERT_EQ(thresholds.size(), nlist);
+        float max_reg_val = (1 + params.regLambda * (nlist - params.kreg)) + 10;
+        for (size_t ik = 0; ik < nlist; ik++) {
+            float reg = index.compute_regularization(
+                    ik + 1, params.regLambda, params.kreg);
+            for (int t = 0; t < 200; t++) {
+                float score_k = uniform(rng);
+                float nonconf = std::min(score_k / index.MAX_DISTANCE, 1.0f);
+                bool stops = ((1 - nonconf) + reg) / max_reg_val > lamhat;
+                EXPECT_EQ(stops, score_k <= thresholds[ik])
+                        << "ik=" << ik << " score_k=" << score_k;
+            }
+        }
+    }
+}
+
+// ranking the centroids on demand probes the same lists as the upfront
+// coarse assignment, for single queries and for batches large enough for the
+// BLAS distances
+TEST(CONANN, lazy_coarse_assignment_matches) {
+    std::vector<float> xb = make_data(nb, 1819);
+    std::vector<float> xq = make_data(nq * 4, 2021);
+
+    // small prefetch windows rank the centroids in several windows, the
+    // larger nlist exercises the sampled threshold of the ranking
+    auto check = [&](faiss::IndexIVF& index, int nprobe_prefetch) {
+        index.train(nb, xb.data());
+        index.add(nb, xb.data());
+        index.K = k;
+
+        auto [nonconf, preds] = index.compute_scores(
+                faiss::IndexIVF::CalibrationResults{10, 0, 0},
+                nq,
+                xq.data());
+        auto sorted_indices = index.compute_sorted_indices(nonconf);
+        auto reg_nonconf =
+                index.regularize_scores(nonconf, sorted_indices, 0.01, 1);
+
+        std::vector<idx_t> I_ref(k), I_lazy(k);
+        std::vector<float> D_ref(k), D_lazy(k);
+        for (size_t rank : {0, 3, 10}) {
+            faiss::IndexIVF::CalibrationResults params{
+                    reg_nonconf[0][rank], 1, 0.01f};
+            params.nprobe_budget =
+                    index.compute_nprobe_budget(params, nonconf);
+            params.nprobe_prefetch = nprobe_prefetch;
+            for (size_t q = 0; q < nq; q++) {
+                const float* xi = xq.data() + q * d;
+                index.lazy_coarse_assignment = false;
+                index.search_conann(
+                        1, xi, D_ref.data(), I_ref.data(), params);
+                index.lazy_coarse_assignment = true;
+                index.search_conann(
+                        1, xi, D_lazy.data(), I_lazy.data(), params);
+                EXPECT_EQ(I_ref, I_lazy) << "q=" << q << " rank=" << rank;
+                EXPECT_EQ(D_ref, D_lazy) << "q=" << q << " rank=" << rank;
+            }
+
+            std::vector<idx_t> IB_ref(nq * 4 * k), IB_lazy(nq * 4 * k);
+            std::vector<float> DB_ref(nq * 4 * k), DB_lazy(nq * 4 * k);
+            index.lazy_coarse_assignment = false;
+            index.search_conann(
+                    nq * 4, xq.data(), DB_ref.data(), IB_ref.data(), params);
+            index.lazy_coarse_assignment = true;
+            index.search_conann(
+                    nq * 4,
+                    xq.data(),
+                    DB_lazy.data(),
+                    IB_lazy.data(),
+                    params);
+            EXPECT_EQ(IB_ref, IB_lazy) << "rank=" << rank;
+            EXPECT_EQ(DB_ref, DB_lazy) << "rank=" << rank;
+        }
+    };
+
+    {
+        faiss::IndexFlatL2 quantizer(d);
+        faiss::IndexIVFFlat index(&quantizer, d, nlist);
+        check(index, 0);
+    }
+    {
+        faiss::IndexFlatIP quantizer(d);
+        faiss::IndexIVFFlat index(
+                &quantizer, d, 256, faiss::METRIC_INNER_PRODUCT);
+        check(index, 2);
+    }
+}
+
+// the intra-query parallel modes merge the lists in probe order and stop
+// at the same step as the sequential search
+TEST(CONANN, intra_query_parallel_matches) {
+    std::vector<float> xb = make_data(nb, 2223);
+    std::vector<float> xq = make_data(nq, 2425);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+    index.K = k;
+
+    faiss::IndexIVF::CalibrationResults all{10, 0, 0};
+    auto [nonconf_ref, preds_ref] = index.compute_scores(all, nq, xq.data());
+    auto sorted_indices = index.compute_sorted_indices(nonconf_ref);
+    auto reg_nonconf =
+            index.regularize_scores(nonconf_ref, sorted_indices, 0.01, 1);
+
+    for (int pmode : {1, 2}) {
+        index.parallel_mode = pmode;
+        auto [nonconf, preds] = index.compute_scores(all, nq, xq.data());
+        EXPECT_EQ(nonconf, nonconf_ref) << "pmode=" << pmode;
+        EXPECT_EQ(preds.offsets, preds_ref.offsets) << "pmode=" << pmode;
+        for (size_t e = 0; e < preds.entries.size(); e++) {
+            EXPECT_EQ(preds.entries[e].id, preds_ref.entries[e].id);
+            EXPECT_EQ(preds.entries[e].first_step,
+                      preds_ref.entries[e].first_step);
+            EXPECT_EQ(preds.entries[e].last_step,
+                      preds_ref.entries[e].last_step);
+        }
+        index.parallel_mode = 0;
+    }
+
+    std::vector<idx_t> I_ref(nq * k), I(nq * k);
+    std::vector<float> D_ref(nq * k), D(nq * k);
+    for (size_t rank : {0, 3, 10}) {
+        faiss::IndexIVF::CalibrationResults params{
+                reg_nonconf[0][rank], 1, 0.01f};
+        params.nprobe_budget =
+                index.compute_nprobe_budget(params, nonconf_ref);
+        index.parallel_mode = 0;
+        index.search_conann(nq, xq.data(), D_ref.data(), I_ref.data(), params);
+        for (int pmode : {1, 2}) {
+            index.parallel_mode = pmode;
+            index.search_conann(nq, xq.data(), D.data(), I.data(), params);
+            EXPECT_EQ(I, I_ref) << "pmode=" << pmode << " rank=" << rank;
+            EXPECT_EQ(D, D_ref) << "pmode=" << pmode << " rank=" << rank;
+        }
+        index.parallel_mode = 0;
+    }
+}
+
+// scanning the lists cluster-major, in probe rounds over the whole batch,
+// retires each query at the same step as the query-major search
+TEST(CONANN, cluster_major_search_matches) {
+    std::vector<float> xb = make_data(nb, 2627);
+    // repeated queries make groups large enough to be split between threads
+    const size_t nqb = nq * 16;
+    std::vector<float> xq = make_data(nq, 2829);
+    for (size_t rep = 1; rep < 16; rep++) {
+        xq.insert(xq.end(), xq.begin(), xq.begin() + nq * d);
+    }
+
+    auto check = [&](faiss::IndexIVF& index) {
+        auto [nonconf, preds] = index.compute_scores(
+                faiss::IndexIVF::CalibrationResults{10, 0, 0},
+                nq,
+                xq.data());
+        auto sorted_indices = index.compute_sorted_indices(nonconf);
+        auto reg_nonconf =
+                index.regularize_scores(nonconf, sorted_indices, 0.01, 1);
+
+        std::vector<idx_t> I_ref(nqb * k), I(nqb * k);
+        std::vector<float> D_ref(nqb * k), D(nqb * k);
+        for (size_t rank : {0, 3, 10, 31}) {
+            faiss::IndexIVF::CalibrationResults params{
+                    reg_nonconf[0][rank], 1, 0.01f};
+            params.nprobe_budget =
+                    index.compute_nprobe_budget(params, nonconf);
+            params.nprobe_prefetch = 2;
+            index.cluster_major_search = false;
+            index.search_conann(
+                    nqb, xq.data(), D_ref.data(), I_ref.data(), params);
+            index.cluster_major_search = true;
+            index.search_conann(nqb, xq.data(), D.data(), I.data(), params);
+            EXPECT_EQ(I, I_ref) << "rank=" << rank;
+            EXPECT_EQ(D, D_ref) << "rank=" << rank;
+        }
+        // no early stop: a plain search with nprobe = nlist
+        index.cluster_major_search = false;
+        faiss::IndexIVF::CalibrationResults all{10, 0, 0};
+        index.search_conann(nqb, xq.data(), D_ref.data(), I_ref.data(), all);
+        index.cluster_major_search = true;
+        index.search_conann(nqb, xq.data(), D.data(), I.data(), all);
+        EXPECT_EQ(I, I_ref);
+        EXPECT_EQ(D, D_ref);
+    };
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+    index.K = k;
+    check(index);
+    // the budget of codes cuts lists in the middle
+    index.max_codes = 700;
+    check(index);
+
+    // per-query tables of the residual PQ scanner. The precomputed tables
+    // are combined with alignment-dependent SIMD code, which makes the
+    // distances of a query depend on the thread that scans it
+    faiss::IndexFlatL2 quantizer_pq(d);
+    faiss::IndexIVFPQ index_pq(&quantizer_pq, d, nlist, 4, 8);
+    index_pq.use_precomputed_table = -1;
+    index_pq.train(nb, xb.data());
+    index_pq.add(nb, xb.data());
+    index_pq.K = k;
+    check(index_pq);
+
+    // the fast-scan indexes have no scanner to share a list between queries
+    faiss::IndexFlatL2 quantizer_fs(d);
+    faiss::IndexIVFPQFastScan index_fs(&quantizer_fs, d, nlist, 8, 4);
+    index_fs.train(nb, xb.data());
+    index_fs.add(nb, xb.data());
+    index_fs.K = k;
+    index_fs.cluster_major_search = true;
+    std::vector<idx_t> I(nqb * k);
+    std::vector<float> D(nqb * k);
+    faiss::IndexIVF::CalibrationResults all{10, 0, 0};
+    try {
+        index_fs.search_conann(nqb, xq.data(), D.data(), I.data(), all);
+        ADD_FAILURE() << "cluster_major_search accepted by fast-scan";
+    } catch (const faiss::FaissException& e) {
+        EXPECT_NE(std::string(e.what()).find(
+                          "cluster_major_search not supported"),
+                  std::string::npos)
+                << e.what();
+    }
+}
+
+// the fast-scan probe loop stops where the calibration scores it collects
+// say it should, like the scanner-based one
+TEST(CONANN, fast_scan_early_stop_matches_calibration_scores) {
+    std::vector<float> xb = make_data(nb, 3031);
+    std::vector<float> xq = make_data(nq, 3233);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFPQFastScan index(&quantizer, d, nlist, 8, 4);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+    index.K = k;
+
+    auto [nonconf, preds] = index.compute_scores(
+            faiss::IndexIVF::CalibrationResults{10, 0, 0}, nq, xq.data());
+    faiss::ConannPredictionsView view = preds.view();
+    // the top-k only improves as lists are probed
+    for (size_t q = 0; q < nq; q++) {
+        for (size_t ik = 1; ik < nlist; ik++) {
+            EXPECT_LE(nonconf[q][ik], nonconf[q][ik - 1]);
+        }
+    }
+    auto sorted_indices = index.compute_sorted_indices(nonconf);
+    auto reg_nonconf =
+            index.regularize_scores(nonconf, sorted_indices, 0.01, 1);
+
+    std::vector<idx_t> I(nq * k), rec(k);
+    std::vector<float> D(nq * k);
+    for (size_t rank : {0, 3, 10, 31}) {
+        faiss::IndexIVF::CalibrationResults params{
+                reg_nonconf[0][rank], 1, 0.01f};
+        float lamhat = params.lamhat;
+        params.nprobe_budget = index.compute_nprobe_budget(params, nonconf);
+        index.search_conann(nq, xq.data(), D.data(), I.data(), params);
+        for (size_t q = 0; q < nq; q++) {
+            size_t stop = 0;
+            while (stop < nlist && reg_nonconf[q][stop] <= lamhat) {
+                stop++;
+            }
+            std::set<idx_t> ref;
+            if (stop > 0) {
+                size_t n = view.reconstruct(q, stop - 1, rec.data());
+                ref.insert(rec.begin(), rec.begin() + n);
+            }
+            std::set<idx_t> got;
+            for (int j = 0; j < k; j++) {
+                if (I[q * k + j] >= 0) {
+                    got.insert(I[q * k + j]);
+                }
+            }
+            EXPECT_EQ(ref, got) << "q=" << q << " lamhat=" << lamhat;
+        }
+
+        // prefetch windows and query-parallel batches give the same results
+        std::vector<idx_t> I2(nq * k);
+        std::vector<float> D2(nq * k);
+        params.nprobe_prefetch = 2;
+        index.parallel_mode = 3;
+        index.search_conann(nq, xq.data(), D2.data(), I2.data(), params);
+        index.parallel_mode = 0;
+        EXPECT_EQ(I, I2) << "lamhat=" << lamhat;
+        EXPECT_EQ(D, D2) << "lamhat=" << lamhat;
+    }
+
+    // max_codes bounds the codes scanned per query
+    faiss::IndexIVF::CalibrationResults all{10, 0, 0};
+    index.max_codes = 300;
+    faiss::indexIVF_stats.reset();
+    index.search_conann(nq, xq.data(), D.data(), I.data(), all);
+    EXPECT_LE(faiss::indexIVF_stats.ndis, nq * 300);
+    EXPECT_GT(faiss::indexIVF_stats.ndis, 0);
+    index.max_codes = 0;
+
+    // the intra-query parallel modes are not implemented on fast-scan
+    index.parallel_mode = 1;
+    EXPECT_THROW(
+            index.search_conann(nq, xq.data(), D.data(), I.data(), all),
+            faiss::FaissException);
+    index.parallel_mode = 0;
+}
+
+// queries far from the calibration ones can need more probes than
+// nprobe_budget: they go on past it and get the results of an unbounded
+// search, on all the probe loops
+TEST(CONANN, queries_past_nprobe_budget_match_unbounded_search) {
+    std::vector<float> xb = make_data(nb, 3435);
+    std::vector<float> xcalib = make_data(nq, 3637);
+    // fewer than 20 queries: the coarse assignment of the batch and the one
+    // of the extension rank the centroids with the same distances
+    const size_t nood = 16;
+    std::vector<float> xq = make_data(nood, 3839);
+    for (auto& v : xq) {
+        v *= 1.5f;
+    }
+
+    auto check = [&](faiss::IndexIVF& index, bool fast_scan) {
+        // the k-th distance weighs on the scores, not only the probe rank
+        index.MAX_DISTANCE = 50;
+        auto [nonconf, preds] = index.compute_scores(
+                faiss::IndexIVF::CalibrationResults{10, 0, 0},
+                nq,
+                xcalib.data());
+        auto sorted_indices = index.compute_sorted_indices(nonconf);
+        auto reg_nonconf =
+                index.regularize_scores(nonconf, sorted_indices, 0.01, 1);
+        auto [nonconf_ood, preds_ood] = index.compute_scores(
+                faiss::IndexIVF::CalibrationResults{10, 0, 0},
+                nood,
+                xq.data());
+
+        std::vector<idx_t> I_ref(nood * k), I(nood * k);
+        std::vector<float> D_ref(nood * k), D(nood * k);
+        size_t nexceed = 0, ndiff = 0;
+        for (size_t rank : {3, 10, 20}) {
+            faiss::IndexIVF::CalibrationResults params{
+                    reg_nonconf[0][rank], 1, 0.01f};
+            params.nprobe_budget =
+                    index.compute_nprobe_budget(params, nonconf);
+            std::vector<int> counts =
+                    index.compute_probe_counts(params, nonconf_ood);
+            for (int c : counts) {
+                nexceed += c > params.nprobe_budget;
+            }
+
+            faiss::IndexIVF::CalibrationResults unbounded = params;
+            unbounded.nprobe_budget = nlist;
+            index.search_conann(
+                    nood, xq.data(), D_ref.data(), I_ref.data(), unbounded);
+
+            std::vector<int> pmodes = {0, 1};
+            if (fast_scan) {
+                pmodes = {0, 3};
+            }
+            for (int pmode : pmodes) {
+                index.parallel_mode = pmode;
+                index.search_conann(nood, xq.data(), D.data(), I.data(), params);
+                EXPECT_EQ(I, I_ref) << "pmode=" << pmode << " rank=" << rank;
+                EXPECT_EQ(D, D_ref) << "pmode=" << pmode << " rank=" << rank;
+            }
+            index.parallel_mode = 0;
+            if (!fast_scan) {
+                index.lazy_coarse_assignment = true;
+                index.search_conann(nood, xq.data(), D.data(), I.data(), params);
+                index.lazy_coarse_assignment = false;
+                EXPECT_EQ(I, I_ref) << "lazy rank=" << rank;
+                EXPECT_EQ(D, D_ref) << "lazy rank=" << rank;
+                index.cluster_major_search = true;
+                index.search_conann(nood, xq.data(), D.data(), I.data(), params);
+                index.cluster_major_search = false;
+                EXPECT_EQ(I, I_ref) << "cluster-major rank=" << rank;
+                EXPECT_EQ(D, D_ref) << "cluster-major rank=" << rank;
+            }
+
+            // a hard cap cuts the queries that needed more probes
+            index.extend_nprobe_budget = false;
+            index.search_conann(nood, xq.data(), D.data(), I.data(), params);
+            index.extend_nprobe_budget = true;
+            ndiff += I != I_ref;
+        }
+        EXPECT_GT(nexceed, 0);
+        EXPECT_GT(ndiff, 0);
+    };
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+    index.K = k;
+    check(index, false);
+
+    faiss::IndexFlatL2 quantizer_fs(d);
+    faiss::IndexIVFPQFastScan index_fs(&quantizer_fs, d, nlist, 8, 4);
+    index_fs.train(nb, xb.data());
+    index_fs.add(nb, xb.data());
+    index_fs.K = k;
+    check(index_fs, true);
+}
+
+// with a refine index, the results and the scores are the exact distances
+// of the re-ranked shortlist, and the early stop still matches them
+TEST(CONANN, refine_early_stop_matches_calibration_scores) {
+    std::vector<float> xb = make_data(nb, 3435);
+    std::vector<float> xq = make_data(nq, 3637);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFPQ index(&quantizer, d, nlist, 4, 4);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+    faiss::IndexFlatL2 refine(d);
+    refine.add(nb, xb.data());
+    index.refine_index = &refine;
+    index.refine_k_factor = 3;
+    index.K = k;
+
+    auto [nonconf, preds] = index.compute_scores(
+            faiss::IndexIVF::CalibrationResults{10, 0, 0}, nq, xq.data());
+    faiss::ConannPredictionsView view = preds.view();
+    for (size_t q = 0; q < nq; q++) {
+        for (size_t ik = 1; ik < nlist; ik++) {
+            EXPECT_LE(nonconf[q][ik], nonconf[q][ik - 1]);
+        }
+    }
+    auto sorted_indices = index.compute_sorted_indices(nonconf);
+    auto reg_nonconf =
+            index.regularize_scores(nonconf, sorted_indices, 0.01, 1);
+
+    std::vector<idx_t> I(nq * k), rec(k);
+    std::vector<float> D(nq * k);
+    for (size_t rank : {0, 3, 10, 31}) {
+        faiss::IndexIVF::CalibrationResults params{
+                reg_nonconf[0][rank], 1, 0.01f};
+        float lamhat = params.lamhat;
+        params.nprobe_budget = index.compute_nprobe_budget(params, nonconf);
+        index.search_conann(nq, xq.data(), D.data(), I.data(), params);
+        for (size_t q = 0; q < nq; q++) {
+            size_t stop = 0;
+            while (stop < nlist && reg_nonconf[q][stop] <= lamhat) {
+                stop++;
+            }
+            std::set<idx_t> ref;
+            if (stop > 0) {
+                size_t n = view.reconstruct(q, stop - 1, rec.data());
+                ref.insert(rec.begin(), rec.begin() + n);
+            }
+            std::set<idx_t> got;
+            for (int j = 0; j < k; j++) {
+                idx_t id = I[q * k + j];
+                if (id < 0) {
+                    continue;
+                }
+                got.insert(id);
+                EXPECT_EQ(D[q * k + j],
+                          faiss::fvec_L2sqr(
+                                  xq.data() + q * d, xb.data() + id * d, d));
+            }
+            EXPECT_EQ(ref, got) << "q=" << q << " lamhat=" << lamhat;
+        }
+    }
+
+    // the labels address refine_index: same size and sequential ids
+    faiss::IndexIVF::CalibrationResults all{10, 0, 0};
+    faiss::IndexFlatL2 refine_half(d);
+    refine_half.add(nb / 2, xb.data());
+    index.refine_index = &refine_half;
+    EXPECT_THROW(
+            index.search_conann(nq, xq.data(), D.data(), I.data(), all),
+            faiss::FaissException);
+
+    faiss::IndexFlatL2 quantizer2(d);
+    faiss::IndexIVFPQ index2(&quantizer2, d, nlist, 4, 4);
+    index2.train(nb, xb.data());
+    std::vector<idx_t> ids(nb);
+    for (size_t i = 0; i < nb; i++) {
+        ids[i] = i + 1000;
+    }
+    index2.add_with_ids(nb, xb.data(), ids.data());
+    index2.refine_index = &refine;
+    index2.K = k;
+    EXPECT_THROW(
+            index2.search_conann(nq, xq.data(), D.data(), I.data(), all),
+            faiss::FaissException);
+    EXPECT_THROW(
+            index2.calibrate(
+                    0.1, k, 0.5, 0.2, xq.data(), nq, nullptr, 20, "test"),
+            faiss::FaissException);
+    index.refine_index = nullptr;
+}
+
+// the HNSW search stops before the first step whose score exceeds lamhat,
+// with the top-k that calibration recorded for the previous step
+TEST(CONANN, hnsw_early_stop_matches_calibration_scores) {
+    std::vector<float> xb = make_data(nb, 3435);
+    std::vector<float> xq = make_data(nq, 3637);
+
+    faiss::IndexHNSWFlat index(d, 16);
+    index.add(nb, xb.data());
+
+    const int n_steps = 40;
+    faiss::ConannHNSW conann(&index, 64, 4, n_steps, 64);
+    conann.reg_lambda = 0.01;
+    auto [nonconf, preds] = conann.compute_scores(k, nq, xq.data());
+    faiss::ConannPredictionsView view = preds.view();
+    std::vector<std::vector<float>> scores(nq);
+    for (size_t q = 0; q < nq; q++) {
+        for (int i = 0; i < n_steps; i++) {
+            scores[q].push_back(conann.step_score(nonconf[q][i], i));
+            if (i > 0) {
+                EXPECT_LE(nonconf[q][i], nonconf[q][i - 1]);
+            }
+        }
+    }
+
+    faiss::hnsw_stats.reset();
+    conann.K = k;
+    std::vector<idx_t> I(nq * k), rec(k);
+    std::vector<float> D(nq * k);
+    conann.search(nq, xq.data(), D.data(), I.data());
+    size_t ndis_full = faiss::hnsw_stats.ndis;
+
+    for (int rank : {1, 5, 20}) {
+        conann.lamhat = scores[0][rank];
+        faiss::hnsw_stats.reset();
+        conann.search(nq, xq.data(), D.data(), I.data());
+        EXPECT_LT(faiss::hnsw_stats.ndis, ndis_full);
+        for (size_t q = 0; q < nq; q++) {
+            int stop = 0;
+            while (stop < n_steps && scores[q][stop] <= conann.lamhat) {
+                stop++;
+            }
+            std::set<idx_t> ref;
+            if (stop > 0) {
+                size_t n = view.reconstruct(q, stop - 1, rec.data());
+                ref.insert(rec.begin(), rec.begin() + n);
+            }
+            std::set<idx_t> got;
+            for (int j = 0; j < k; j++) {
+                if (I[q * k + j] >= 0) {
+                    got.insert(I[q * k + j]);
+                }
+                if (j > 0) {
+                    EXPECT_LE(D[q * k + j - 1], D[q * k + j]);
+                }
+            }
+            EXPECT_EQ(ref, got) << "q=" << q << " lamhat=" << conann.lamhat;
+        }
+    }
+
+    // the calibrated lamhat meets the target FNR on the calibration queries
+    faiss::IndexFlatL2 exact(d);
+    exact.add(nb, xb.data());
+    std::vector<idx_t> gt(nq * k);
+    std::vector<float> gt_dis(nq * k);
+    exact.search(nq, xq.data(), k, gt_dis.data(), gt.data());
+    float alpha = 0.2;
+    conann.calibrate(alpha, k, nq, xq.data(), gt.data());
+    ASSERT_LE(conann.lamhat, 1);
+    conann.search(nq, xq.data(), D.data(), I.data());
+    size_t nhit = 0;
+    for (size_t q = 0; q < nq; q++) {
+        std::set<idx_t> ref(gt.begin() + q * k, gt.begin() + (q + 1) * k);
+        for (int j = 0; j < k; j++) {
+            nhit += ref.count(I[q * k + j]);
+        }
+    }
+    EXPECT_LE(1 - float(nhit) / (nq * k),
+              faiss::IndexIVF::conformal_target_fnr(alpha, nq) + 1e-6);
+}
+
+// the mapped cache file gives back the scores and predictions it was
+// written with, and rejects files from another version
+TEST(CONANN, cache_file_roundtrip) {
+    std::vector<float> xb = make_data(nb, 2223);
+    std::vector<float> xq = make_data(nq, 2425);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+    index.K = k;
+
+    auto [nonconf, preds] = index.compute_scores(
+            faiss::IndexIVF::CalibrationResults{10, 0, 0}, nq, xq.data());
+
+    std::string fname = "/tmp/test_conann_cache.cnnc";
+    uint64_t fingerprint = index.conann_fingerprint(xq.data(), nq);
+    faiss::ConannCacheFile::write(fname, fingerprint, nonconf, preds);
+    ASSERT_TRUE(faiss::ConannCacheFile::is_valid(fname));
+    {
+        faiss::ConannCacheFile file(fname);
+        ASSERT_EQ(file.nq(), nq);
+        ASSERT_EQ(file.nlist(), nlist);
+        ASSERT_EQ(file.k(), k);
+        ASSERT_EQ(file.fingerprint(), fingerprint);
+        for (size_t q = 0; q < nq; q++) {
+            std::vector<float> row(
+                    file.nonconf_row(q), file.nonconf_row(q) + nlist);
+            EXPECT_EQ(row, nonconf[q]);
+        }
+        faiss::ConannPredictionsView view = file.preds_view();
+        ASSERT_EQ(view.offsets[nq], (idx_t)preds.entries.size());
+        for (size_t q = 0; q < nq; q++) {
+            ASSERT_EQ(view.end(q) - view.begin(q),
+                      preds.offsets[q + 1] - preds.offsets[q]);
+            for (auto e = view.begin(q), ref = preds.view().begin(q);
+                 e != view.end(q);
+                 e++, ref++) {
+                EXPECT_EQ(e->id, ref->id);
+                EXPECT_EQ(e->first_step, ref->first_step);
+                EXPECT_EQ(e->last_step, ref->last_step);
+            }
+        }
+    }
+
+    // bump the version field in place
+    FILE* f = fopen(fname.c_str(), "r+");
+    ASSERT_TRUE(f);
+    uint32_t version = faiss::ConannCacheFile::current_version + 1;
+    fseek(f, offsetof(faiss::ConannCacheFile::Header, version), SEEK_SET);
+    fwrite(&version, sizeof(version), 1, f);
+    fclose(f);
+    EXPECT_FALSE(faiss::ConannCacheFile::is_valid(fname));
+    EXPECT_THROW(faiss::ConannCacheFile file(fname), faiss::FaissException);
+
+    // a nb of entries whose size in bytes wraps around to a few bytes
+    faiss::ConannCacheFile::write(fname, fingerprint, nonconf, preds);
+    ASSERT_TRUE(faiss::ConannCacheFile::is_valid(fname));
+    f = fopen(fname.c_str(), "r+");
+    ASSERT_TRUE(f);
+    uint64_t n_entries = UINT64_MAX / sizeof(faiss::ConannTopkEntry) + 1;
+    fseek(f, offsetof(faiss::ConannCacheFile::Header, n_entries), SEEK_SET);
+    fwrite(&n_entries, sizeof(n_entries), 1, f);
+    fclose(f);
+    EXPECT_FALSE(faiss::ConannCacheFile::is_valid(fname));
+    EXPECT_THROW(faiss::ConannCacheFile file(fname), faiss::FaissException);
+    remove(fname.c_str());
+}
+
+// the cache key changes with anything the calibration scores depend on
+TEST(CONANN, fingerprint_tracks_inputs) {
+    std::vector<float> xb = make_data(nb, 2627);
+    std::vector<float> xq = make_data(nq, 2829);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb / 2, xb.data());
+    index.K = k;
+
+    uint64_t fp = index.conann_fingerprint(xq.data(), nq);
+    EXPECT_EQ(fp, index.conann_fingerprint(xq.data(), nq));
+
+    // other query block
+    EXPECT_NE(fp, index.conann_fingerprint(xq.data(), nq - 1));
+    std::vector<float> xq2 = xq;
+    xq2[7] += 1e-3;
+    EXPECT_NE(fp, index.conann_fingerprint(xq2.data(), nq));
+
+    // other K and MAX_DISTANCE
+    index.K = k + 1;
+    EXPECT_NE(fp, index.conann_fingerprint(xq.data(), nq));
+    index.K = k;
+    index.MAX_DISTANCE *= 2;
+    EXPECT_NE(fp, index.conann_fingerprint(xq.data(), nq));
+    index.MAX_DISTANCE /= 2;
+    EXPECT_EQ(fp, index.conann_fingerprint(xq.data(), nq));
+
+    // more vectors in the inverted lists
+    index.add(nb / 2, xb.data() + nb / 2 * d);
+    uint64_t fp_full = index.conann_fingerprint(xq.data(), nq);
+    EXPECT_NE(fp, fp_full);
+
+    // retrained centroids (other clustering seed)
+    faiss::IndexFlatL2 quantizer2(d);
+    faiss::IndexIVFFlat index2(&quantizer2, d, nlist);
+    index2.cp.seed = 4321;
+    index2.train(nb, xb.data());
+    index2.add(nb, xb.data());
+    index2.K = k;
+    EXPECT_NE(fp_full, index2.conann_fingerprint(xq.data(), nq));
+
+    // the content and the type of refine_index
+    faiss::IndexFlatL2 refine(d);
+    refine.add(nb, xb.data());
+    index.refine_index = &refine;
+    uint64_t fp_refine = index.conann_fingerprint(xq.data(), nq);
+    EXPECT_NE(fp_full, fp_refine);
+    std::vector<float> xb2 = xb;
+    xb2[nb * d - 1] += 1e-3;
+    faiss::IndexFlatL2 refine2(d);
+    refine2.add(nb, xb2.data());
+    index.refine_index = &refine2;
+    EXPECT_NE(fp_refine, index.conann_fingerprint(xq.data(), nq));
+    faiss::IndexFlat refine_ip(d, faiss::METRIC_INNER_PRODUCT);
+    refine_ip.add(nb, xb.data());
+    index.refine_index = &refine_ip;
+    EXPECT_NE(fp_refine, index.conann_fingerprint(xq.data(), nq));
+    faiss::IndexHNSWFlat refine_hnsw(d, 16);
+    refine_hnsw.add(nb, xb.data());
+    index.refine_index = &refine_hnsw;
+    uint64_t fp_hnsw = index.conann_fingerprint(xq.data(), nq);
+    EXPECT_NE(fp_refine, fp_hnsw);
+    faiss::IndexHNSWFlat refine_hnsw2(d, 16);
+    refine_hnsw2.add(nb, xb2.data());
+    index.refine_index = &refine_hnsw2;
+    EXPECT_NE(fp_hnsw, index.conann_fingerprint(xq.data(), nq));
+    index.refine_index = nullptr;
+}
+
+// a calibrated index read back from disk serves the same conformal queries
+// without recalibrating
+TEST(CONANN, calibration_roundtrip_index_io) {
+    std::vector<float> xb = make_data(nb, 3031);
+    std::vector<float> xq = make_data(nq * 4, 3233);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+
+    faiss::IndexFlatL2 exact(d);
+    exact.add(nb, xb.data());
+    std::vector<idx_t> gt(nq * 4 * k);
+    std::vector<float> gt_dis(nq * 4 * k);
+    exact.search(nq * 4, xq.data(), k, gt_dis.data(), gt.data());
+
+    auto calib = index.calibrate(
+            0.1, k, 0.5, 0.2, xq.data(), nq * 4, gt.data(), 50, "io_test");
+    ASSERT_TRUE(index.is_calibrated);
+
+    // without the flag: the stock format, no calibration
+    faiss::VectorIOWriter plain_writer;
+    faiss::write_index(&index, &plain_writer);
+    faiss::VectorIOReader plain_reader;
+    plain_reader.data = plain_writer.data;
+    std::unique_ptr<faiss::Index> plain(faiss::read_index(&plain_reader));
+    ASSERT_TRUE(plain_writer.data.size() >= 4);
+    EXPECT_EQ(memcmp(plain_writer.data.data(), "IwFl", 4), 0);
+    EXPECT_FALSE(dynamic_cast<faiss::IndexIVF*>(plain.get())->is_calibrated);
+
+    // a calibrated IVF nested in another index is written in the stock
+    // format, and the flag is for the top-level IVF only
+    faiss::IndexPreTransform wrapper(&index);
+    faiss::VectorIOWriter wrapper_writer;
+    faiss::write_index(&wrapper, &wrapper_writer);
+    std::string wrapper_bytes(
+            wrapper_writer.data.begin(), wrapper_writer.data.end());
+    EXPECT_EQ(wrapper_bytes.find("CnAN"), std::string::npos);
+    EXPECT_THROW(
+            faiss::write_index(
+                    &wrapper,
+                    &wrapper_writer,
+                    faiss::IO_FLAG_CONANN_CALIBRATION),
+            faiss::FaissException);
+
+    faiss::VectorIOWriter writer;
+    faiss::write_index(&index, &writer, faiss::IO_FLAG_CONANN_CALIBRATION);
+    faiss::VectorIOReader reader;
+    reader.data = writer.data;
+    std::unique_ptr<faiss::Index> loaded(faiss::read_index(&reader));
+    auto* ivf = dynamic_cast<faiss::IndexIVF*>(loaded.get());
+    ASSERT_TRUE(ivf);
+    ASSERT_TRUE(ivf->is_calibrated);
+    EXPECT_EQ(ivf->K, k);
+    EXPECT_EQ(ivf->MAX_DISTANCE, 50);
+    EXPECT_EQ(ivf->calibration.lamhat, calib.lamhat);
+    EXPECT_EQ(ivf->calibration.kreg, calib.kreg);
+    EXPECT_EQ(ivf->calibration.regLambda, calib.regLambda);
+    EXPECT_EQ(ivf->calibration.nprobe_budget, calib.nprobe_budget);
+    EXPECT_EQ(ivf->calibration.nprobe_prefetch, calib.nprobe_prefetch);
+    // the threshold table is loaded, not recompiled
+    EXPECT_EQ(ivf->stop_thresholds, index.stop_thresholds);
+
+    std::vector<idx_t> I_ref(nq * k), I_new(nq * k);
+    std::vector<float> D_ref(nq * k), D_new(nq * k);
+    index.search_conann(nq, xq.data(), D_ref.data(), I_ref.data(), calib);
+    ivf->search_conann(nq, xq.data(), D_new.data(), I_new.data());
+    EXPECT_EQ(I_ref, I_new);
+    EXPECT_EQ(D_ref, D_new);
+}
+
+// calibrating block by block, without keeping the predictions, gives the
+// same lamhat and test metrics as calibrating all the queries at once
+TEST(CONANN, streaming_calibration_matches) {
+    std::vector<float> xb = make_data(nb, 3435);
+    std::vector<float> xq = make_data(nq * 4, 3637);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+
+    faiss::IndexFlatL2 exact(d);
+    exact.add(nb, xb.data());
+    std::vector<idx_t> gt(nq * 4 * k);
+    std::vector<float> gt_dis(nq * 4 * k);
+    exact.search(nq * 4, xq.data(), k, gt_dis.data(), gt.data());
+
+    auto ref = index.calibrate(
+            0.1, k, 0.5, 0.2, xq.data(), nq * 4, gt.data(), 50, "stream_ref");
+    auto ref_test = index.evaluate_test(ref);
+    ASSERT_EQ(index.calib_preds.size(), index.calib_nonconf.size());
+
+    index.calibration_block_size = 7;
+    auto res = index.calibrate(
+            0.1, k, 0.5, 0.2, xq.data(), nq * 4, gt.data(), 50, "stream");
+    // the predictions were dropped
+    EXPECT_EQ(index.calib_preds.size(), 0);
+    EXPECT_EQ(index.test_preds.size(), 0);
+    EXPECT_EQ(index.calib_hits.size(), index.calib_nonconf.size());
+    EXPECT_EQ(res.lamhat, ref.lamhat);
+    EXPECT_EQ(res.kreg, ref.kreg);
+    EXPECT_EQ(res.regLambda, ref.regLambda);
+    EXPECT_EQ(res.nprobe_budget, ref.nprobe_budget);
+
+    auto test = index.evaluate_test(res);
+    EXPECT_EQ(test.first, ref_test.first);
+    EXPECT_EQ(test.second, ref_test.second);
+}
+
+// the online calibrator reproduces calibrate() on the same queries, and a
+// sliding window only depends on the queries it still holds
+TEST(CONANN, online_calibration_matches) {
+    std::vector<float> xb = make_data(nb, 3839);
+    std::vector<float> xq = make_data(nq * 4, 4041);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+
+    faiss::IndexFlatL2 exact(d);
+    exact.add(nb, xb.data());
+    std::vector<idx_t> gt(nq * 4 * k);
+    std::vector<float> gt_dis(nq * 4 * k);
+    exact.search(nq * 4, xq.data(), k, gt_dis.data(), gt.data());
+
+    auto calib = index.calibrate(
+            0.1, k, 0.5, 0.2, xq.data(), nq * 4, gt.data(), 50, "online");
+    size_t calib_nq = index.calib_nonconf.size();
+
+    // the calibration split, added in two batches
+    faiss::ConannOnlineCalibrator online(&index, 0.1, 0);
+    EXPECT_FALSE(online.snapshot());
+    size_t n0 = calib_nq / 3;
+    online.add(n0, xq.data(), gt.data());
+    online.add(calib_nq - n0, xq.data() + n0 * d, gt.data() + n0 * k);
+    auto snap = online.snapshot();
+    ASSERT_TRUE(snap);
+    EXPECT_EQ(snap->version, 2);
+    EXPECT_EQ(snap->n_queries, calib_nq);
+    EXPECT_EQ(snap->params.lamhat, calib.lamhat);
+    EXPECT_EQ(snap->params.nprobe_budget,
+              index.compute_nprobe_budget(calib, index.calib_nonconf));
+    auto budgets = calib;
+    index.set_probe_budgets(
+            budgets, index.compute_probe_counts(calib, index.calib_nonconf));
+    EXPECT_EQ(snap->params.nprobe_prefetch, budgets.nprobe_prefetch);
+    // lamhat above 1 never stops: all the lists, nothing held back
+    budgets.lamhat = 2;
+    index.set_probe_budgets(
+            budgets, index.compute_probe_counts(budgets, index.calib_nonconf));
+    EXPECT_EQ(budgets.nprobe_budget, nlist);
+    EXPECT_EQ(budgets.nprobe_prefetch, 0);
+    EXPECT_EQ(snap->stop_thresholds, index.compile_stop_thresholds(calib));
+
+    // window of 60 queries: the first batch is entirely evicted
+    size_t w = 60;
+    faiss::ConannOnlineCalibrator sliding(&index, 0.1, w);
+    sliding.add(50, xq.data(), gt.data());
+    sliding.add(w, xq.data() + 50 * d, gt.data() + 50 * k);
+    EXPECT_EQ(sliding.size(), w);
+    faiss::ConannOnlineCalibrator fresh(&index, 0.1, w);
+    fresh.add(w, xq.data() + 50 * d, gt.data() + 50 * k);
+    EXPECT_EQ(sliding.snapshot()->params.lamhat,
+              fresh.snapshot()->params.lamhat);
+    EXPECT_EQ(sliding.snapshot()->params.nprobe_budget,
+              fresh.snapshot()->params.nprobe_budget);
+
+    // searching with the published snapshot
+    std::vector<idx_t> I_ref(nq * k), I_new(nq * k);
+    std::vector<float> D_ref(nq * k), D_new(nq * k);
+    index.search_conann(
+            nq, xq.data(), D_ref.data(), I_ref.data(), sliding.snapshot()->params);
+    sliding.search(nq, xq.data(), D_new.data(), I_new.data());
+    EXPECT_EQ(I_ref, I_new);
+    EXPECT_EQ(D_ref, D_new);
+
+    // add() only reads the index: batches added while other searches run
+    // give the same calibration as sequential adds
+    faiss::ConannOnlineCalibrator concurrent(&index, 0.1, w);
+    concurrent.add(w, xq.data(), gt.data());
+    std::thread adder([&] {
+        for (size_t i0 = w; i0 + 20 <= nq * 4; i0 += 20) {
+            concurrent.add(20, xq.data() + i0 * d, gt.data() + i0 * k);
+        }
+    });
+    std::vector<idx_t> I_conc(nq * k);
+    std::vector<float> D_conc(nq * k);
+    for (int rep = 0; rep < 5; rep++) {
+        concurrent.search(nq, xq.data(), D_conc.data(), I_conc.data());
+        index.search_conann(
+                nq, xq.data(), D_new.data(), I_new.data(), calib);
+    }
+    adder.join();
+    faiss::ConannOnlineCalibrator sequential(&index, 0.1, w);
+    sequential.add(w, xq.data(), gt.data());
+    for (size_t i0 = w; i0 + 20 <= nq * 4; i0 += 20) {
+        sequential.add(20, xq.data() + i0 * d, gt.data() + i0 * k);
+    }
+    EXPECT_EQ(concurrent.snapshot()->version, sequential.snapshot()->version);
+    EXPECT_EQ(concurrent.snapshot()->params.lamhat,
+              sequential.snapshot()->params.lamhat);
+    EXPECT_EQ(concurrent.snapshot()->stop_thresholds,
+              sequential.snapshot()->stop_thresholds);
+}
+
+// for IndexIVFFlat the last step of the sweep is the exact kNN, so the
+// fused ground truth gives the same calibration as an external one
+TEST(CONANN, fused_ground_truth_matches) {
+    std::vector<float> xb = make_data(nb, 4243);
+    std::vector<float> xq = make_data(nq * 4, 4445);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+
+    faiss::IndexFlatL2 exact(d);
+    exact.add(nb, xb.data());
+    std::vector<idx_t> gt(nq * 4 * k);
+    std::vector<float> gt_dis(nq * 4 * k);
+    exact.search(nq * 4, xq.data(), k, gt_dis.data(), gt.data());
+
+    auto ref = index.calibrate(
+            0.1, k, 0.5, 0.2, xq.data(), nq * 4, gt.data(), 50, "gt_ref");
+    auto ref_labels = index.calib_labels;
+    auto ref_test = index.evaluate_test(ref);
+
+    auto res = index.calibrate(
+            0.1, k, 0.5, 0.2, xq.data(), nq * 4, nullptr, 50, "gt_fused");
+    ASSERT_EQ(index.calib_labels.size(), ref_labels.size());
+    for (size_t q = 0; q < ref_labels.size(); q++) {
+        std::set<idx_t> a(ref_labels[q].begin(), ref_labels[q].end());
+        std::set<idx_t> b(
+                index.calib_labels[q].begin(), index.calib_labels[q].end());
+        EXPECT_EQ(a, b) << "q=" << q;
+    }
+    EXPECT_EQ(res.lamhat, ref.lamhat);
+    EXPECT_EQ(res.regLambda, ref.regLambda);
+    auto test = index.evaluate_test(res);
+    EXPECT_EQ(test.first, ref_test.first);
+    EXPECT_EQ(test.second, ref_test.second);
+
+    // same in streaming mode, where the labels are read block by block
+    index.calibration_block_size = 7;
+    auto streamed = index.calibrate(
+            0.1, k, 0.5, 0.2, xq.data(), nq * 4, nullptr, 50, "gt_stream");
+    EXPECT_EQ(streamed.lamhat, ref.lamhat);
+}
+
+// the top-k trajectory of a smaller k is contained in the sweep of a larger
+// one: deriving it gives the same scores and predictions as its own sweep
+TEST(CONANN, restrict_scores_matches_sweep) {
+    std::vector<float> xb = make_data(nb, 4647);
+    std::vector<float> xq = make_data(nq, 4849);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+
+    index.K = 3 * k;
+    auto [nonconf_max, preds_max] = index.compute_scores(
+            faiss::IndexIVF::CalibrationResults{10, 0, 0}, nq, xq.data());
+    index.K = k;
+    auto [nonconf, preds] = index.compute_scores(
+            faiss::IndexIVF::CalibrationResults{10, 0, 0}, nq, xq.data());
+
+    auto [nonconf_k, preds_k] =
+            index.restrict_scores(nonconf_max, preds_max.view(), k);
+    EXPECT_EQ(nonconf_k, nonconf);
+    ASSERT_EQ(preds_k.nq, nq);
+    std::vector<idx_t> a(k), b(k);
+    for (size_t q = 0; q < nq; q++) {
+        for (size_t step = 0; step < nlist; step++) {
+            size_t na = preds.view().reconstruct(q, step, a.data());
+            size_t nb_ = preds_k.view().reconstruct(q, step, b.data());
+            EXPECT_EQ(std::set<idx_t>(a.begin(), a.begin() + na),
+                      std::set<idx_t>(b.begin(), b.begin() + nb_))
+                    << "q=" << q << " step=" << step;
+        }
+    }
+}
+
+// multi-k calibration gives the same results as one calibration per k
+TEST(CONANN, multi_k_calibration_matches) {
+    std::vector<float> xb = make_data(nb, 5051);
+    std::vector<float> xq = make_data(nq * 4, 5253);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+
+    faiss::IndexFlatL2 exact(d);
+    exact.add(nb, xb.data());
+    std::vector<int> ks = {5, 20, 10};
+    int k_max = 20;
+    std::vector<idx_t> gt(nq * 4 * k_max);
+    std::vector<float> gt_dis(nq * 4 * k_max);
+    exact.search(nq * 4, xq.data(), k_max, gt_dis.data(), gt.data());
+
+    auto multi = index.calibrate(
+            0.1, ks, 0.5, 0.2, xq.data(), nq * 4, gt.data(), 50, "multi_k");
+    ASSERT_EQ(multi.size(), ks.size());
+    EXPECT_EQ(index.K, k_max);
+    EXPECT_EQ(index.calibration.lamhat, multi[1].lamhat);
+
+    for (size_t i = 0; i < ks.size(); i++) {
+        int ki = ks[i];
+        std::vector<idx_t> gt_k(nq * 4 * ki);
+        for (size_t q = 0; q < nq * 4; q++) {
+            std::copy(gt.begin() + q * k_max, gt.begin() + q * k_max + ki,
+                      gt_k.begin() + q * ki);
+        }
+        faiss::IndexIVFFlat single(&quantizer, d, nlist);
+        single.add(nb, xb.data());
+        auto ref = single.calibrate(
+                0.1, ki, 0.5, 0.2, xq.data(), nq * 4, gt_k.data(), 50, "k");
+        EXPECT_EQ(multi[i].lamhat, ref.lamhat) << "k=" << ki;
+        EXPECT_EQ(multi[i].regLambda, ref.regLambda) << "k=" << ki;
+        EXPECT_EQ(multi[i].nprobe_budget, ref.nprobe_budget) << "k=" << ki;
+    }
+}
+
+// a mixed-k batch returns, for each query, the results of search_conann
+// with its own k and calibration
+TEST(CONANN, variable_k_search_matches) {
+    std::vector<float> xb = make_data(nb, 5455);
+    std::vector<float> xq = make_data(nq * 4, 5657);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+
+    faiss::IndexFlatL2 exact(d);
+    exact.add(nb, xb.data());
+    std::vector<int> table_ks = {5, 10, 20};
+    std::vector<idx_t> gt(nq * 4 * 20);
+    std::vector<float> gt_dis(nq * 4 * 20);
+    exact.search(nq * 4, xq.data(), 20, gt_dis.data(), gt.data());
+    auto table = index.calibrate(
+            0.1, table_ks, 0.5, 0.2, xq.data(), nq * 4, gt.data(), 50, "var_k");
+
+    std::vector<idx_t> ks(nq);
+    for (size_t i = 0; i < nq; i++) {
+        ks[i] = table_ks[(i * 7) % 3];
+    }
+    faiss::RangeSearchResult res(nq);
+    index.search_conann(nq, xq.data(), ks.data(), table_ks, table, &res);
+
+    for (size_t j = 0; j < table_ks.size(); j++) {
+        int kj = table_ks[j];
+        index.K = kj;
+        std::vector<idx_t> I(nq * kj);
+        std::vector<float> D(nq * kj);
+        index.search_conann(nq, xq.data(), D.data(), I.data(), table[j]);
+        for (size_t i = 0; i < nq; i++) {
+            if (ks[i] != kj) {
+                continue;
+            }
+            ASSERT_EQ(res.lims[i + 1] - res.lims[i], kj);
+            for (int r = 0; r < kj; r++) {
+                EXPECT_EQ(res.labels[res.lims[i] + r], I[i * kj + r]);
+                EXPECT_EQ(res.distances[res.lims[i] + r], D[i * kj + r]);
+            }
+        }
+    }
+
+    // k without calibration
+    ks[3] = 7;
+    faiss::RangeSearchResult res2(nq);
+    EXPECT_THROW(
+            index.search_conann(nq, xq.data(), ks.data(), table_ks, table, &res2),
+            faiss::FaissException);
+}
+
+// an alpha grid calibrated in one pass matches one calibration per alpha,
+// and a mixed-alpha batch matches the per-alpha searches
+TEST(CONANN, alpha_grid_matches) {
+    std::vector<float> xb = make_data(nb, 5859);
+    std::vector<float> xq = make_data(nq * 4, 6061);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+
+    faiss::IndexFlatL2 exact(d);
+    exact.add(nb, xb.data());
+    std::vector<idx_t> gt(nq * 4 * k);
+    std::vector<float> gt_dis(nq * 4 * k);
+    exact.search(nq * 4, xq.data(), k, gt_dis.data(), gt.data());
+
+    std::vector<float> table_alphas = {0.05, 0.1, 0.2};
+    auto table = index.calibrate_alpha_grid(
+            table_alphas, k, 0.5, 0.2, xq.data(), nq * 4, gt.data(), 50,
+            "alpha_grid");
+    ASSERT_EQ(table.size(), table_alphas.size());
+    for (size_t j = 0; j < table_alphas.size(); j++) {
+        faiss::IndexIVFFlat single(&quantizer, d, nlist);
+        single.add(nb, xb.data());
+        auto ref = single.calibrate(
+                table_alphas[j], k, 0.5, 0.2, xq.data(), nq * 4, gt.data(),
+                50, "alpha");
+        EXPECT_EQ(table[j].lamhat, ref.lamhat) << "alpha=" << table_alphas[j];
+        EXPECT_EQ(table[j].regLambda, ref.regLambda);
+        EXPECT_EQ(table[j].nprobe_budget, ref.nprobe_budget);
+    }
+
+    // budgets between the table entries, and one below the table
+    std::vector<float> alphas(nq);
+    const float budgets[] = {0.01, 0.07, 0.1, 0.5};
+    const int expected[] = {-1, 0, 1, 2};
+    for (size_t i = 0; i < nq; i++) {
+        alphas[i] = budgets[i % 4];
+    }
+    std::vector<idx_t> I(nq * k);
+    std::vector<float> D(nq * k);
+    index.search_conann(
+            nq, xq.data(), alphas.data(), table_alphas, table, D.data(),
+            I.data());
+
+    for (int e = 0; e < 4; e++) {
+        auto cal = expected[e] < 0 ? faiss::IndexIVF::CalibrationResults{2, 0, 0}
+                                   : table[expected[e]];
+        std::vector<idx_t> I_ref(nq * k);
+        std::vector<float> D_ref(nq * k);
+        index.search_conann(nq, xq.data(), D_ref.data(), I_ref.data(), cal);
+        for (size_t i = e; i < nq; i += 4) {
+            for (int r = 0; r < k; r++) {
+                EXPECT_EQ(I[i * k + r], I_ref[i * k + r]) << "i=" << i;
+                EXPECT_EQ(D[i * k + r], D_ref[i * k + r]) << "i=" << i;
+            }
+        }
+    }
+}
+
+namespace {
+
+// records the lists passed to prefetch_lists
+struct RecordingInvertedLists : faiss::ArrayInvertedLists {
+    using faiss::ArrayInvertedLists::ArrayInvertedLists;
+    mutable std::mutex mutex;
+    mutable size_t n_prefetched = 0;
+
+    void prefetch_lists(const idx_t* list_nos, int n) const override {
+        std::lock_guard<std::mutex> lock(mutex);
+        n_prefetched += n;
+    }
+};
+
+} // namespace
+
+// the early-stopping search prefetches a window of lists per query instead
+// of all of its nprobe lists, without changing the results
+TEST(CONANN, prefetch_window) {
+    std::vector<float> xb = make_data(nb, 6263);
+    std::vector<float> xq = make_data(nq * 4, 6465);
+
+    faiss::IndexFlatL2 quantizer(d);
+    faiss::IndexIVFFlat index(&quantizer, d, nlist);
+    index.train(nb, xb.data());
+    index.add(nb, xb.data());
+
+    RecordingInvertedLists rec(nlist, index.code_size);
+    for (size_t l = 0; l < nlist; l++) {
+        faiss::InvertedLists::ScopedCodes codes(index.invlists, l);
+        faiss::InvertedLists::ScopedIds ids(index.invlists, l);
+        rec.add_entries(l, index.invlists->list_size(l), ids.get(), codes.get());
+    }
+    index.replace_invlists(&rec, false);
+
+    faiss::IndexFlatL2 exact(d);
+    exact.add(nb, xb.data());
+    std::vector<idx_t> gt(nq * 4 * k);
+    std::vector<float> gt_dis(nq * 4 * k);
+    exact.search(nq * 4, xq.data(), k, gt_dis.data(), gt.data());
+    auto calib = index.calibrate(
+            0.1, k, 0.5, 0.2, xq.data(), nq * 4, gt.data(), 50, "prefetch");
+    ASSERT_GT(calib.nprobe_prefetch, 0);
+    ASSERT_LE(calib.nprobe_prefetch, calib.nprobe_budget);
+
+    // same policy with the upfront and the lazy coarse assignments
+    std::vector<idx_t> I_ref(nq * k), I(nq * k);
+    std::vector<float> D_ref(nq * k), D(nq * k);
+    for (bool lazy : {false, true}) {
+        index.lazy_coarse_assignment = lazy;
+        auto all = calib;
+        all.nprobe_prefetch = 0;
+        rec.n_prefetched = 0;
+        index.search_conann(nq, xq.data(), D_ref.data(), I_ref.data(), all);
+        EXPECT_EQ(rec.n_prefetched, nq * calib.nprobe_budget)
+                << "lazy=" << lazy;
+
+        rec.n_prefetched = 0;
+        index.search_conann(nq, xq.data(), D.data(), I.data(), calib);
+        EXPECT_GE(rec.n_prefetched, nq * calib.nprobe_prefetch)
+                << "lazy=" << lazy;
+        EXPECT_LE(rec.n_prefetched, nq * calib.nprobe_budget)
+                << "lazy=" << lazy;
+        EXPECT_EQ(I, I_ref);
+        EXPECT_EQ(D, D_ref);
+    }
+    index.replace_invlists(nullptr, false);
+}